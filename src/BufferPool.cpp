@@ -0,0 +1,123 @@
+/*
+    Copyright (c) 2025 Cellie https://github.com/CelliesProjects/OpenStreetMap-esp32
+
+    Permission is hereby granted, free of charge, to any person obtaining a copy
+    of this software and associated documentation files (the "Software"), to deal
+    in the Software without restriction, including without limitation the rights
+    to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+    copies of the Software, and to permit persons to whom the Software is
+    furnished to do so, subject to the following conditions:
+
+    The above copyright notice and this permission notice shall be included in all
+    copies or substantial portions of the Software.
+
+    THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+    IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+    FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+    AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+    LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+    OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+    SOFTWARE.
+    SPDX-License-Identifier: MIT
+    */
+
+#include "BufferPool.hpp"
+
+BufferPool &BufferPool::global()
+{
+    static BufferPool pool;
+    return pool;
+}
+
+BufferPool::BufferPool() : mutex(xSemaphoreCreateMutex())
+{
+}
+
+uint8_t *BufferPool::borrow(size_t size)
+{
+    int sizeClass = 0;
+    while (sizeClass < CLASSES && (OSM_BUFFERPOOL_MIN_SLOT << sizeClass) < size)
+        ++sizeClass;
+
+    uint8_t *slot = nullptr;
+    xSemaphoreTake(mutex, portMAX_DELAY);
+    if (sizeClass < CLASSES)
+    {
+        const size_t slotSize = OSM_BUFFERPOOL_MIN_SLOT << sizeClass;
+        if (!freeSlots[sizeClass].empty())
+        {
+            slot = freeSlots[sizeClass].back();
+            freeSlots[sizeClass].pop_back();
+        }
+        else if (stats.poolBytes + slotSize <= OSM_BUFFERPOOL_MAX_BYTES)
+        {
+            slot = static_cast<uint8_t *>(heap_caps_malloc(HEADER_SIZE + slotSize, MALLOC_CAP_SPIRAM));
+            if (slot)
+            {
+                freeSlots[sizeClass].reserve(OSM_BUFFERPOOL_MAX_BYTES / slotSize); // no reallocation when it comes back
+                ++stats.slots;
+                stats.poolBytes += slotSize;
+            }
+        }
+
+        if (slot)
+        {
+            slot[0] = sizeClass;
+            ++stats.borrowed;
+            stats.bytesInUse += slotSize;
+            stats.highWater = std::max(stats.highWater, stats.bytesInUse);
+        }
+    }
+    if (!slot)
+        ++stats.misses;
+    xSemaphoreGive(mutex);
+
+    if (!slot)
+    {
+        // Too large or the pool is at its limit
+        slot = static_cast<uint8_t *>(heap_caps_malloc(HEADER_SIZE + size, MALLOC_CAP_SPIRAM));
+        if (!slot)
+            slot = static_cast<uint8_t *>(malloc(HEADER_SIZE + size));
+        if (!slot)
+            return nullptr;
+        slot[0] = HEAP_CLASS;
+    }
+    return slot + HEADER_SIZE;
+}
+
+void BufferPool::giveBack(uint8_t *buffer)
+{
+    if (!buffer)
+        return;
+
+    uint8_t *slot = buffer - HEADER_SIZE;
+    const uint8_t sizeClass = slot[0];
+    if (sizeClass == HEAP_CLASS)
+    {
+        heap_caps_free(slot);
+        return;
+    }
+
+    xSemaphoreTake(mutex, portMAX_DELAY);
+    freeSlots[sizeClass].push_back(slot);
+    stats.bytesInUse -= OSM_BUFFERPOOL_MIN_SLOT << sizeClass;
+    xSemaphoreGive(mutex);
+}
+
+BufferPoolStats BufferPool::getStats()
+{
+    xSemaphoreTake(mutex, portMAX_DELAY);
+    const BufferPoolStats current = stats;
+    xSemaphoreGive(mutex);
+    return current;
+}
+
+void BufferPool::resetStats()
+{
+    // Only the counters, the slots and the bytes in use stay as they are
+    xSemaphoreTake(mutex, portMAX_DELAY);
+    stats.borrowed = 0;
+    stats.misses = 0;
+    stats.highWater = stats.bytesInUse;
+    xSemaphoreGive(mutex);
+}
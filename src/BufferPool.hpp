@@ -0,0 +1,73 @@
+/*
+    Copyright (c) 2025 Cellie https://github.com/CelliesProjects/OpenStreetMap-esp32
+
+    Permission is hereby granted, free of charge, to any person obtaining a copy
+    of this software and associated documentation files (the "Software"), to deal
+    in the Software without restriction, including without limitation the rights
+    to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+    copies of the Software, and to permit persons to whom the Software is
+    furnished to do so, subject to the following conditions:
+
+    The above copyright notice and this permission notice shall be included in all
+    copies or substantial portions of the Software.
+
+    THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+    IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+    FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+    AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+    LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+    OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+    SOFTWARE.
+    SPDX-License-Identifier: MIT
+    */
+
+#ifndef BUFFERPOOL_HPP_
+#define BUFFERPOOL_HPP_
+
+#include <Arduino.h>
+#include <vector>
+
+constexpr size_t OSM_BUFFERPOOL_MIN_SLOT = 4 * 1024;
+constexpr size_t OSM_BUFFERPOOL_MAX_SLOT = 128 * 1024;   // largest expected tile
+constexpr size_t OSM_BUFFERPOOL_MAX_BYTES = 1024 * 1024; // psram the pool may grow to
+
+struct BufferPoolStats
+{
+    uint32_t borrowed;    // buffers handed out by the pool
+    uint32_t misses;      // buffers the pool could not serve, allocated from the heap instead
+    uint32_t slots;       // psram slots allocated by the pool
+    uint32_t poolBytes;   // psram held by the pool
+    uint32_t bytesInUse;  // borrowed and not returned yet
+    uint32_t highWater;   // most bytes in use at once
+};
+
+// Download buffers in power of two size classes, kept in psram and reused
+// Slots are allocated on demand and never freed, so buffers do not fragment the heap over time
+class BufferPool
+{
+public:
+    static BufferPool &global();
+
+    BufferPool(const BufferPool &) = delete;
+    BufferPool &operator=(const BufferPool &) = delete;
+
+    uint8_t *borrow(size_t size);
+    void giveBack(uint8_t *buffer);
+    BufferPoolStats getStats();
+    void resetStats();
+
+private:
+    BufferPool();
+
+    static constexpr int CLASSES = 6; // 4kB up to OSM_BUFFERPOOL_MAX_SLOT
+    static constexpr size_t HEADER_SIZE = 8;  // size class in front of every buffer
+    static constexpr uint8_t HEAP_CLASS = 0xff;
+
+    static_assert(OSM_BUFFERPOOL_MIN_SLOT << (CLASSES - 1) == OSM_BUFFERPOOL_MAX_SLOT, "size classes must end at OSM_BUFFERPOOL_MAX_SLOT");
+
+    SemaphoreHandle_t mutex;
+    std::vector<uint8_t *> freeSlots[CLASSES];
+    BufferPoolStats stats = {};
+};
+
+#endif
@@ -33,6 +33,18 @@ struct CachedTile
     uint8_t z;
     bool valid;
     bool busy;
+    bool referenced;
+    bool prefetching; // busy with a prefetch job that no map waits for
+    bool prefetched;  // filled by a prefetch job and not used by a map yet
+    bool outdated;    // a refresh replaced the tile in the stores while it was decoded, the next map reloads it
+    uint32_t neededFrame;
+    int newer; // slots before and after this one in the recency list, -1 at its ends
+    int older;
+    uint16_t cropX; // part of the tile held in buffer, the full tile unless cropping is enabled
+    uint16_t cropY;
+    uint16_t cropW;
+    uint16_t cropH;
+    bool pooled; // buffer belongs to a TilePool and is not freed here
     uint16_t *buffer;
 
     CachedTile()
@@ -41,6 +53,18 @@ struct CachedTile
           z(0),
           valid(false),
           busy(false),
+          referenced(false),
+          prefetching(false),
+          prefetched(false),
+          outdated(false),
+          neededFrame(0),
+          newer(-1),
+          older(-1),
+          cropX(0),
+          cropY(0),
+          cropW(0),
+          cropH(0),
+          pooled(false),
           buffer(nullptr)
     {
     }
@@ -53,16 +77,26 @@ struct CachedTile
     bool allocate(int tileSize)
     {
         buffer = static_cast<uint16_t *>(heap_caps_malloc(tileSize * tileSize * sizeof(uint16_t), MALLOC_CAP_SPIRAM));
+        cropX = cropY = 0;
+        cropW = cropH = tileSize;
         return buffer != nullptr;
     }
 
+    bool covers(uint16_t x0, uint16_t y0, uint16_t w, uint16_t h) const
+    {
+        return x0 >= cropX && y0 >= cropY && x0 + w <= cropX + cropW && y0 + h <= cropY + cropH;
+    }
+
+    bool isCropped(int tileSize) const
+    {
+        return cropW != tileSize || cropH != tileSize;
+    }
+
     void free()
     {
-        if (buffer)
-        {
+        if (buffer && !pooled)
             heap_caps_free(buffer);
-            buffer = nullptr;
-        }
+        buffer = nullptr;
         valid = false;
         busy = false;
     }
@@ -0,0 +1,211 @@
+/*
+    Copyright (c) 2025 Cellie https://github.com/CelliesProjects/OpenStreetMap-esp32
+
+    Permission is hereby granted, free of charge, to any person obtaining a copy
+    of this software and associated documentation files (the "Software"), to deal
+    in the Software without restriction, including without limitation the rights
+    to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+    copies of the Software, and to permit persons to whom the Software is
+    furnished to do so, subject to the following conditions:
+
+    The above copyright notice and this permission notice shall be included in all
+    copies or substantial portions of the Software.
+
+    THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+    IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+    FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+    AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+    LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+    OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+    SOFTWARE.
+    SPDX-License-Identifier: MIT
+    */
+
+#include "CompressedTileCache.hpp"
+
+CompressedTileCache::~CompressedTileCache()
+{
+    freeEntries();
+    if (mutex)
+        vSemaphoreDelete(mutex);
+}
+
+bool CompressedTileCache::resize(uint32_t newMaxBytes)
+{
+    if (!mutex)
+    {
+        mutex = xSemaphoreCreateMutex();
+        if (!mutex)
+        {
+            log_e("Failed to create compressed cache mutex");
+            return false;
+        }
+    }
+
+    xSemaphoreTake(mutex, portMAX_DELAY);
+    freeEntries();
+    maxBytes = newMaxBytes;
+    maxEntries = std::max<size_t>(16, maxBytes / OSM_COMPRESSEDCACHE_BYTES_PER_ENTRY);
+    if (maxBytes)
+        index.reserve(maxEntries);
+    else
+        index.clear();
+    xSemaphoreGive(mutex);
+    return true;
+}
+
+void CompressedTileCache::clear()
+{
+    if (!mutex)
+        return;
+
+    xSemaphoreTake(mutex, portMAX_DELAY);
+    freeEntries();
+    if (maxBytes)
+        index.reserve(maxEntries);
+    xSemaphoreGive(mutex);
+}
+
+void CompressedTileCache::freeEntries()
+{
+    for (Entry &entry : entries)
+        heap_caps_free(entry.data);
+    std::vector<Entry>().swap(entries);
+    index.clear();
+    totalBytes = 0;
+    newestEntry = oldestEntry = -1;
+}
+
+void CompressedTileCache::unlinkEntry(int position)
+{
+    Entry &entry = entries[position];
+    if (entry.newer >= 0)
+        entries[entry.newer].older = entry.older;
+    else
+        newestEntry = entry.older;
+    if (entry.older >= 0)
+        entries[entry.older].newer = entry.newer;
+    else
+        oldestEntry = entry.newer;
+    entry.newer = entry.older = -1;
+}
+
+void CompressedTileCache::linkNewest(int position)
+{
+    Entry &entry = entries[position];
+    entry.older = newestEntry;
+    if (newestEntry >= 0)
+        entries[newestEntry].newer = position;
+    newestEntry = position;
+    if (oldestEntry < 0)
+        oldestEntry = position;
+}
+
+void CompressedTileCache::removeEntry(size_t position)
+{
+    unlinkEntry(position);
+    heap_caps_free(entries[position].data);
+    totalBytes -= entries[position].size;
+    index.erase(entries[position].key);
+    if (position != entries.size() - 1)
+    {
+        // The last entry fills the hole, its neighbours in the recency list follow it
+        Entry &moved = entries[position];
+        moved = entries.back();
+        if (moved.newer >= 0)
+            entries[moved.newer].older = position;
+        else
+            newestEntry = position;
+        if (moved.older >= 0)
+            entries[moved.older].newer = position;
+        else
+            oldestEntry = position;
+        index.insert(moved.key, position);
+    }
+    entries.pop_back();
+}
+
+void CompressedTileCache::evictOldest()
+{
+    removeEntry(oldestEntry);
+    ++stats.evictions;
+}
+
+MemoryBuffer CompressedTileCache::read(uint32_t x, uint32_t y, uint8_t z)
+{
+    if (!isEnabled())
+        return MemoryBuffer::empty();
+
+    xSemaphoreTake(mutex, portMAX_DELAY);
+    const int position = index.find(TileCacheIndex::makeKey(x, y, z));
+    if (position < 0)
+    {
+        ++stats.misses;
+        xSemaphoreGive(mutex);
+        return MemoryBuffer::empty();
+    }
+
+    unlinkEntry(position);
+    linkNewest(position);
+    const Entry &entry = entries[position];
+    MemoryBuffer buffer(entry.size);
+    if (buffer.isAllocated())
+    {
+        memcpy(buffer.get(), entry.data, entry.size);
+        ++stats.hits;
+    }
+    else
+        ++stats.misses;
+    xSemaphoreGive(mutex);
+    return buffer;
+}
+
+void CompressedTileCache::store(uint32_t x, uint32_t y, uint8_t z, const uint8_t *png, size_t size)
+{
+    if (!isEnabled() || !png || !size || size > maxBytes)
+        return;
+
+    const uint64_t key = TileCacheIndex::makeKey(x, y, z);
+
+    xSemaphoreTake(mutex, portMAX_DELAY);
+    if (size > maxBytes)
+    {
+        xSemaphoreGive(mutex); // resized meanwhile
+        return;
+    }
+
+    const int existing = index.find(key);
+    if (existing >= 0)
+        removeEntry(existing);
+
+    while (!entries.empty() && (totalBytes + size > maxBytes || entries.size() >= maxEntries))
+        evictOldest();
+
+    uint8_t *data = static_cast<uint8_t *>(heap_caps_malloc(size, MALLOC_CAP_SPIRAM));
+    if (!data)
+    {
+        log_w("Compressed cache allocation failed");
+        xSemaphoreGive(mutex);
+        return;
+    }
+
+    memcpy(data, png, size);
+    entries.push_back({key, data, static_cast<uint32_t>(size), -1, -1});
+    linkNewest(entries.size() - 1);
+    index.insert(key, entries.size() - 1);
+    totalBytes += size;
+    xSemaphoreGive(mutex);
+}
+
+CompressedCacheStats CompressedTileCache::getStats()
+{
+    if (!mutex)
+        return stats;
+
+    xSemaphoreTake(mutex, portMAX_DELAY);
+    CompressedCacheStats result = stats;
+    result.tiles = entries.size();
+    result.bytes = totalBytes;
+    xSemaphoreGive(mutex);
+    return result;
+}
@@ -0,0 +1,90 @@
+/*
+    Copyright (c) 2025 Cellie https://github.com/CelliesProjects/OpenStreetMap-esp32
+
+    Permission is hereby granted, free of charge, to any person obtaining a copy
+    of this software and associated documentation files (the "Software"), to deal
+    in the Software without restriction, including without limitation the rights
+    to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+    copies of the Software, and to permit persons to whom the Software is
+    furnished to do so, subject to the following conditions:
+
+    The above copyright notice and this permission notice shall be included in all
+    copies or substantial portions of the Software.
+
+    THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+    IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+    FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+    AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+    LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+    OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+    SOFTWARE.
+    SPDX-License-Identifier: MIT
+    */
+
+#ifndef COMPRESSEDTILECACHE_HPP_
+#define COMPRESSEDTILECACHE_HPP_
+
+#include <Arduino.h>
+#include <vector>
+#include <atomic>
+
+#include "TileCacheIndex.hpp"
+#include "MemoryBuffer.hpp"
+
+constexpr uint32_t OSM_COMPRESSEDCACHE_BYTES_PER_ENTRY = 4096; // used to bound the number of stored tiles
+
+struct CompressedCacheStats
+{
+    uint32_t hits;
+    uint32_t misses;
+    uint32_t evictions;
+    uint32_t tiles;
+    uint32_t bytes;
+};
+
+// Keeps downloaded PNG data in psram so evicted tiles can be decoded again without network
+class CompressedTileCache
+{
+public:
+    CompressedTileCache() = default;
+    ~CompressedTileCache();
+
+    CompressedTileCache(const CompressedTileCache &) = delete;
+    CompressedTileCache &operator=(const CompressedTileCache &) = delete;
+
+    bool resize(uint32_t maxBytes);
+    void clear();
+    bool isEnabled() const { return maxBytes.load() > 0; };
+
+    MemoryBuffer read(uint32_t x, uint32_t y, uint8_t z);
+    void store(uint32_t x, uint32_t y, uint8_t z, const uint8_t *png, size_t size);
+    CompressedCacheStats getStats();
+
+private:
+    struct Entry
+    {
+        uint64_t key;
+        uint8_t *data;
+        uint32_t size;
+        int newer; // entries before and after this one in the recency list, -1 at its ends
+        int older;
+    };
+
+    SemaphoreHandle_t mutex = nullptr;
+    std::vector<Entry> entries;
+    TileCacheIndex index;
+    std::atomic<uint32_t> maxBytes{0}; // changed under the mutex, read without it by isEnabled
+    size_t maxEntries = 0;
+    uint32_t totalBytes = 0;
+    int newestEntry = -1;
+    int oldestEntry = -1;
+    CompressedCacheStats stats = {};
+
+    void freeEntries();
+    void evictOldest();
+    void removeEntry(size_t position);
+    void unlinkEntry(int position);
+    void linkNewest(int position);
+};
+
+#endif
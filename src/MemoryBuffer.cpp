@@ -27,12 +27,36 @@
 MemoryBuffer::MemoryBuffer(size_t size) : size_(size)
 {
     if (size_ > 0)
-        buffer_ = std::unique_ptr<uint8_t[]>(new (std::nothrow) uint8_t[size]);
+        buffer_ = BufferPool::global().borrow(size);
+}
+
+MemoryBuffer::~MemoryBuffer()
+{
+    BufferPool::global().giveBack(buffer_);
+}
+
+MemoryBuffer::MemoryBuffer(MemoryBuffer &&other) noexcept : size_(other.size_), buffer_(other.buffer_)
+{
+    other.size_ = 0;
+    other.buffer_ = nullptr;
+}
+
+MemoryBuffer &MemoryBuffer::operator=(MemoryBuffer &&other) noexcept
+{
+    if (this != &other)
+    {
+        BufferPool::global().giveBack(buffer_);
+        size_ = other.size_;
+        buffer_ = other.buffer_;
+        other.size_ = 0;
+        other.buffer_ = nullptr;
+    }
+    return *this;
 }
 
 uint8_t *MemoryBuffer::get()
 {
-    return buffer_.get();
+    return buffer_;
 }
 
 size_t MemoryBuffer::size() const
@@ -40,9 +64,16 @@ size_t MemoryBuffer::size() const
     return size_;
 }
 
+// Only the size changes, the buffer keeps its slot
+void MemoryBuffer::truncate(size_t size)
+{
+    if (size < size_)
+        size_ = size;
+}
+
 bool MemoryBuffer::isAllocated()
 {
-    return buffer_.get() != nullptr;
+    return buffer_ != nullptr;
 }
 
 MemoryBuffer MemoryBuffer::empty()
@@ -26,20 +26,29 @@
 
 #include <Arduino.h>
 #include <memory>
+#include "BufferPool.hpp"
 
+// Owns a buffer borrowed from the global BufferPool
 class MemoryBuffer
 {
 public:
     explicit MemoryBuffer(size_t size);
+    ~MemoryBuffer();
+
+    MemoryBuffer(MemoryBuffer &&other) noexcept;
+    MemoryBuffer &operator=(MemoryBuffer &&other) noexcept;
+    MemoryBuffer(const MemoryBuffer &) = delete;
+    MemoryBuffer &operator=(const MemoryBuffer &) = delete;
 
     uint8_t *get();
     size_t size() const;
+    void truncate(size_t size);
     bool isAllocated();
     static MemoryBuffer empty();
 
 private:
     size_t size_;
-    std::unique_ptr<uint8_t[]> buffer_;
+    uint8_t *buffer_ = nullptr;
 };
 
 #endif // MEMORYBUFFER_H
@@ -22,27 +22,67 @@
     */
 
 #include "OpenStreetMap-esp32.hpp"
+#include <numeric>
+#include <cfloat>
+#include <climits>
 
 OpenStreetMap::~OpenStreetMap()
 {
-    if (jobQueue && tasksStarted)
+    if (cacheMutex)
     {
-        constexpr TileJob poison = {0, 0, 255, nullptr};
-        for (int i = 0; i < numberOfWorkers; ++i)
-            if (xQueueSend(jobQueue, &poison, portMAX_DELAY) != pdPASS)
-                log_e("Failed to send poison pill to tile worker %d", i);
-
-        for (int i = 0; i < numberOfWorkers; ++i)
-            ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
+        uint32_t requestId;
+        MapReadyCallback onReady;
+        xSemaphoreTake(cacheMutex, portMAX_DELAY);
+        takeAsyncRequest(requestId, onReady);
+        xSemaphoreGive(cacheMutex);
+        if (onReady)
+            onReady(requestId, false);
+    }
 
-        ownerTask = nullptr;
-        tasksStarted = false;
-        numberOfWorkers = 0;
+    stopTileWorkerTasks();
 
+    if (jobQueue)
+    {
         vQueueDelete(jobQueue);
         jobQueue = nullptr;
     }
 
+    if (decodeQueue)
+    {
+        vQueueDelete(decodeQueue);
+        decodeQueue = nullptr;
+    }
+
+    if (prefetchQueue)
+    {
+        vQueueDelete(prefetchQueue);
+        prefetchQueue = nullptr;
+    }
+
+    if (jobSignal)
+    {
+        vSemaphoreDelete(jobSignal);
+        jobSignal = nullptr;
+    }
+
+    if (jobEvents)
+    {
+        vEventGroupDelete(jobEvents);
+        jobEvents = nullptr;
+    }
+
+    if (cacheMutex)
+    {
+        vSemaphoreDelete(cacheMutex);
+        cacheMutex = nullptr;
+    }
+
+    if (spriteMutex)
+    {
+        vSemaphoreDelete(spriteMutex);
+        spriteMutex = nullptr;
+    }
+
     freeTilesCache();
 
     if (pngCore0)
@@ -61,8 +101,27 @@ OpenStreetMap::~OpenStreetMap()
 
 void OpenStreetMap::setSize(uint16_t w, uint16_t h)
 {
-    mapWidth = w;
-    mapHeight = h;
+    viewWidth = w;
+    viewHeight = h;
+    mapWidth = w + 2 * overscanMargin;
+    mapHeight = h + 2 * overscanMargin;
+    backingReady = false;
+}
+
+bool OpenStreetMap::setOverscan(uint16_t marginPixels)
+{
+    if (!lockWhenIdle())
+    {
+        log_e("Can not change overscan while a map is being fetched");
+        return false;
+    }
+
+    overscanMargin = marginPixels;
+    setSize(viewWidth, viewHeight);
+    if (!overscanMargin)
+        backingMap.deleteSprite();
+    unlockCache();
+    return true;
 }
 
 double OpenStreetMap::lon2tile(double lon, uint8_t zoom)
@@ -132,46 +191,245 @@ void OpenStreetMap::computeRequiredTiles(double longitude, double latitude, uint
     }
 }
 
-CachedTile *OpenStreetMap::findUnusedTile(const tileList &requiredTiles, uint8_t zoom)
+CachedTile *OpenStreetMap::findUnusedTile()
+{
+    CachedTile *tile = (cachePolicy == CachePolicy::CLOCK) ? findClockTile() : findLeastRecentlyUsedTile();
+    if (!tile)
+        return nullptr; // no unused tile found
+
+    if (tile->valid)
+        ++cacheStats.evictions;
+    tile->busy = true;
+    return tile;
+}
+
+CachedTile *OpenStreetMap::findLeastRecentlyUsedTile()
+{
+    // Empty slots sit at the oldest end, so this usually stops at the first slot it looks at
+    for (int slot = oldestTile; slot >= 0; slot = tilesCache[slot].newer)
+    {
+        CachedTile &tile = tilesCache[slot];
+        if (!tile.busy && tile.neededFrame != currentFrame)
+            return &tile;
+    }
+    return nullptr;
+}
+
+CachedTile *OpenStreetMap::findSpareTile()
+{
+    // Slots without a tile sit at the oldest end, the first valid tile ends the search
+    for (int slot = oldestTile; slot >= 0; slot = tilesCache[slot].newer)
+    {
+        CachedTile &tile = tilesCache[slot];
+        if (tile.valid)
+            break;
+        if (!tile.busy && tile.neededFrame != currentFrame)
+            return &tile;
+    }
+    return nullptr;
+}
+
+CachedTile *OpenStreetMap::findClockTile()
 {
-    for (auto &tile : tilesCache)
+    // Two sweeps: the first may only clear reference bits, the second then finds a victim
+    for (size_t i = 0; i < tilesCache.size() * 2; ++i)
     {
-        if (tile.busy)
+        CachedTile &tile = tilesCache[evictionHand];
+        evictionHand = (evictionHand + 1) % tilesCache.size();
+
+        if (tile.busy || tile.neededFrame == currentFrame)
             continue;
 
-        // If a tile is valid but not required in the current frame, we can replace it
-        bool needed = false;
-        for (const auto &[x, y] : requiredTiles)
+        if (tile.valid && tile.referenced)
         {
-            if (tile.x == x && tile.y == y && tile.z == zoom && tile.valid)
-            {
-                needed = true;
-                break;
-            }
+            tile.referenced = false; // second chance
+            continue;
         }
-        if (!needed)
+        return &tile;
+    }
+    return nullptr;
+}
+
+void OpenStreetMap::touchTile(CachedTile &tile)
+{
+    tile.referenced = true;
+
+    const int slot = &tile - tilesCache.data();
+    unlinkTile(slot);
+    linkTile(slot, true);
+}
+
+void OpenStreetMap::retireTile(CachedTile &tile)
+{
+    // A slot without a usable tile is the cheapest victim
+    tile.valid = false;
+    const int slot = &tile - tilesCache.data();
+    unlinkTile(slot);
+    linkTile(slot, false);
+}
+
+void OpenStreetMap::unlinkTile(int slot)
+{
+    CachedTile &tile = tilesCache[slot];
+    if (tile.newer >= 0)
+        tilesCache[tile.newer].older = tile.older;
+    else if (newestTile == slot)
+        newestTile = tile.older;
+    if (tile.older >= 0)
+        tilesCache[tile.older].newer = tile.newer;
+    else if (oldestTile == slot)
+        oldestTile = tile.newer;
+    tile.newer = tile.older = -1;
+}
+
+void OpenStreetMap::linkTile(int slot, bool newest)
+{
+    CachedTile &tile = tilesCache[slot];
+    if (newest)
+    {
+        tile.older = newestTile;
+        if (newestTile >= 0)
+            tilesCache[newestTile].newer = slot;
+        newestTile = slot;
+        if (oldestTile < 0)
+            oldestTile = slot;
+    }
+    else
+    {
+        tile.newer = oldestTile;
+        if (oldestTile >= 0)
+            tilesCache[oldestTile].older = slot;
+        oldestTile = slot;
+        if (newestTile < 0)
+            newestTile = slot;
+    }
+}
+
+CachedTile *OpenStreetMap::isTileCached(uint32_t x, uint32_t y, uint8_t z)
+{
+    const int slot = tilesIndex.find(TileCacheIndex::makeKey(x, y, z));
+    if (slot < 0 || !tilesCache[slot].valid)
+        return nullptr;
+    return &tilesCache[slot];
+}
+
+bool OpenStreetMap::assignTile(CachedTile &tile, uint32_t x, uint32_t y, uint8_t z, const MapRect &part)
+{
+    const int slot = &tile - tilesCache.data();
+    const uint64_t oldKey = TileCacheIndex::makeKey(tile.x, tile.y, tile.z);
+    if (tilesIndex.find(oldKey) == slot)
+        tilesIndex.erase(oldKey);
+
+    tile.x = x;
+    tile.y = y;
+    tile.z = z;
+    tile.valid = false;
+    tile.busy = true;
+    tile.outdated = false;
+    tile.neededFrame = currentFrame;
+    touchTile(tile);
+    tilesIndex.insert(TileCacheIndex::makeKey(x, y, z), slot);
+
+    if (tile.prefetched)
+        ++prefetchStats.wasted;
+    tile.prefetched = false;
+    tile.prefetching = false;
+
+    if (!allocateTileBuffer(tile, part))
+    {
+        tile.busy = false;
+        retireTile(tile);
+        return false;
+    }
+    return true;
+}
+
+bool OpenStreetMap::allocateTileBuffer(CachedTile &tile, const MapRect &part)
+{
+    if (!tileCropping)
+        return true; // fixed full size buffers
+
+    releaseTileBuffer(tile);
+
+    // Evicting only helps while the pool is short of space, holes pinned by busy tiles are not merged by it
+    const size_t bytes = part.w * part.h * sizeof(uint16_t);
+    while (!(tile.buffer = tilePool.allocate(bytes)) && tilePool.freeBytes() < TilePool::bytesFor(1, bytes))
+    {
+        CachedTile *victim = findPoolVictim(tile);
+        if (!victim)
+            break;
+        releaseTileBuffer(*victim);
+        retireTile(*victim);
+        ++cacheStats.evictions;
+    }
+
+    // A fragmented pool never leaves a tile out of the map, the buffer then comes from the heap until the slot is reused
+    if (!tile.buffer)
+    {
+        tile.buffer = static_cast<uint16_t *>(heap_caps_malloc(bytes, MALLOC_CAP_SPIRAM));
+        if (!tile.buffer)
         {
-            tile.busy = true;
-            return &tile;
+            log_e("Tile pool exhausted, could not store %u x %u pixels", part.w, part.h);
+            return false;
         }
+        tile.pooled = false;
+        log_d("Tile pool fragmented, %u x %u pixels stored on the heap", part.w, part.h);
     }
 
-    return nullptr; // no unused tile found
+    tile.cropX = part.x;
+    tile.cropY = part.y;
+    tile.cropW = part.w;
+    tile.cropH = part.h;
+    return true;
 }
 
-CachedTile *OpenStreetMap::isTileCached(uint32_t x, uint32_t y, uint8_t z)
+void OpenStreetMap::releaseTileBuffer(CachedTile &tile)
+{
+    if (tile.pooled)
+        tilePool.release(tile.buffer);
+    else
+        heap_caps_free(tile.buffer);
+    tile.buffer = nullptr;
+    tile.pooled = true; // the next buffer is taken from the pool again
+}
+
+CachedTile *OpenStreetMap::findPoolVictim(const CachedTile &exclude)
 {
-    for (auto &tile : tilesCache)
+    // Only tiles in the pool free space in it
+    for (int slot = oldestTile; slot >= 0; slot = tilesCache[slot].newer)
     {
-        if (tile.x == x && tile.y == y && tile.z == z && tile.valid)
+        CachedTile &tile = tilesCache[slot];
+        if (&tile != &exclude && tile.buffer && tile.pooled && !tile.busy && tile.neededFrame != currentFrame)
             return &tile;
     }
     return nullptr;
 }
 
+MapRect OpenStreetMap::visibleTilePart(size_t tileIndex, bool crop)
+{
+    const int tileSize = currentProvider->tileSize;
+    if (!crop)
+        return {0, 0, static_cast<uint16_t>(tileSize), static_cast<uint16_t>(tileSize)};
+
+    const int drawX = startOffsetX + (tileIndex % numberOfColums) * tileSize;
+    const int drawY = startOffsetY + (tileIndex / numberOfColums) * tileSize;
+    const int left = std::max(0, -drawX);
+    const int top = std::max(0, -drawY);
+    const int right = std::min(tileSize, mapWidth - drawX);
+    const int bottom = std::min(tileSize, mapHeight - drawY);
+    return {static_cast<int16_t>(left), static_cast<int16_t>(top),
+            static_cast<uint16_t>(std::max(right - left, 1)), static_cast<uint16_t>(std::max(bottom - top, 1))};
+}
+
 void OpenStreetMap::freeTilesCache()
 {
     std::vector<CachedTile>().swap(tilesCache);
+    tilePool.end();
+    tilesIndex.clear();
+    newestTile = oldestTile = -1;
+    evictionHand = 0;
+    panSprite = nullptr;
+    backingReady = false;
 }
 
 bool OpenStreetMap::resizeTilesCache(uint16_t numberOfTiles)
@@ -182,287 +440,2128 @@ bool OpenStreetMap::resizeTilesCache(uint16_t numberOfTiles)
         return false;
     }
 
+    if (!lockWhenIdle())
+    {
+        log_e("Can not resize cache while a map is being fetched");
+        return false;
+    }
+
+    const bool allocated = allocateTilesCache(numberOfTiles);
+    unlockCache();
+    return allocated;
+}
+
+bool OpenStreetMap::allocateTilesCache(uint16_t numberOfTiles)
+{
+    // Called with cacheMutex held and no jobs running
     freeTilesCache();
-    tilesCache.resize(numberOfTiles);
 
-    for (auto &tile : tilesCache)
+    if (tileCropping)
     {
-        if (!tile.allocate(currentProvider->tileSize))
+        // Cropped tiles share one pool, so more slots fit in the same memory
+        const size_t tileBytes = currentProvider->tileSize * currentProvider->tileSize * sizeof(uint16_t);
+        if (!tilePool.begin(TilePool::bytesFor(numberOfTiles, tileBytes)))
         {
-            log_e("Tile cache allocation failed!");
-            freeTilesCache();
+            log_e("Tile pool allocation failed!");
             return false;
         }
+        tilesCache.resize(numberOfTiles * OSM_CROPPED_SLOTS_PER_TILE);
+        for (auto &tile : tilesCache)
+            tile.pooled = true;
+    }
+    else
+    {
+        tilesCache.resize(numberOfTiles);
+        for (auto &tile : tilesCache)
+        {
+            if (!tile.allocate(currentProvider->tileSize))
+            {
+                log_e("Tile cache allocation failed!");
+                freeTilesCache();
+                return false;
+            }
+        }
     }
+    tilesIndex.reserve(tilesCache.size());
+    for (size_t slot = 0; slot < tilesCache.size(); ++slot)
+        linkTile(slot, true);
     return true;
 }
 
-void OpenStreetMap::updateCache(const tileList &requiredTiles, uint8_t zoom, TileBufferList &tilePointers)
+bool OpenStreetMap::setTileCropping(bool enabled)
+{
+    if (!lockWhenIdle())
+    {
+        log_e("Can not change cropping while a map is being fetched");
+        return false;
+    }
+
+    bool allocated = true;
+    if (enabled != tileCropping)
+    {
+        // Slot layout changes, so the next fetchMap allocates a fresh cache unless resized before
+        const uint16_t numberOfTiles = tileCropping ? tilesCache.size() / OSM_CROPPED_SLOTS_PER_TILE : tilesCache.size();
+        tileCropping = enabled;
+        freeTilesCache();
+        if (numberOfTiles)
+            allocated = allocateTilesCache(numberOfTiles);
+    }
+    unlockCache();
+    return allocated;
+}
+
+void OpenStreetMap::updateCache(const tileList &requiredTiles, uint8_t zoom, CachedTileList &tilePointers)
 {
-    [[maybe_unused]] const unsigned long startMS = millis();
     std::vector<TileJob> jobs;
     makeJobList(requiredTiles, jobs, zoom, tilePointers);
     if (!jobs.empty())
-    {
         runJobs(jobs);
-        log_i("Finished %i jobs in %lu ms - %i ms/job", jobs.size(), millis() - startMS, (millis() - startMS) / jobs.size());
-    }
 }
 
-void OpenStreetMap::makeJobList(const tileList &requiredTiles, std::vector<TileJob> &jobs, uint8_t zoom, TileBufferList &tilePointers)
+void OpenStreetMap::makeJobList(const tileList &requiredTiles, std::vector<TileJob> &jobs, uint8_t zoom, CachedTileList &tilePointers)
 {
+    ++currentFrame;
+
+    // Mark every cached tile that is needed in this frame so it will not be evicted
     for (const auto &[x, y] : requiredTiles)
     {
+        if (y < 0 || y >= (1 << zoom))
+            continue;
+
+        const int slot = tilesIndex.find(TileCacheIndex::makeKey(x, y, zoom));
+        if (slot >= 0)
+            tilesCache[slot].neededFrame = currentFrame;
+    }
+
+    // Crop only when every tile shows up once, so a visible part belongs to one grid position
+    const bool cropTiles = tileCropping && numberOfColums <= (1 << zoom);
+    std::vector<float> priorities; // one per job
+
+    for (size_t tileIndex = 0; tileIndex < requiredTiles.size(); ++tileIndex)
+    {
+        const auto &[x, y] = requiredTiles[tileIndex];
         if (y < 0 || y >= (1 << zoom))
         {
             tilePointers.push_back(nullptr); // we need to keep 1:1 grid alignment with requiredTiles for composeMap
             continue;
         }
 
-        const CachedTile *cachedTile = isTileCached(x, y, zoom);
-        if (cachedTile)
+        MapRect part = visibleTilePart(tileIndex, cropTiles);
+        CachedTile *tileToReplace = nullptr;
+        const int slot = tilesIndex.find(TileCacheIndex::makeKey(x, y, zoom));
+        if (slot >= 0)
         {
-            tilePointers.push_back(cachedTile->buffer);
-            continue;
+            CachedTile &cachedTile = tilesCache[slot];
+            if (cachedTile.busy || (cachedTile.valid && !cachedTile.outdated && cachedTile.covers(part.x, part.y, part.w, part.h)))
+            {
+                ++cacheStats.hits;
+                if (cachedTile.prefetching || cachedTile.prefetched)
+                    ++prefetchStats.hits;
+                if (cachedTile.prefetching)
+                    addPendingJob(); // already downloading, the map now waits for it
+                cachedTile.prefetching = false;
+                cachedTile.prefetched = false;
+                touchTile(cachedTile);
+                tilePointers.push_back(&cachedTile); // cached or already queued in this frame
+                continue;
+            }
+            if (cachedTile.valid)
+                part = visibleTilePart(tileIndex, false); // cropped copy is too small now, reload the full tile
+            tileToReplace = &cachedTile;              // slot still holds this tile
         }
 
-        // Check if this tile is already in the job list
-        const auto job = std::find_if(jobs.begin(), jobs.end(), [&](const TileJob &job)
-                                      { return job.x == x && job.y == static_cast<uint32_t>(y) && job.z == zoom; });
-        if (job != jobs.end())
+        // A tile that failed recently is left out until its backoff ends, all of them while the server asked to wait
+        if (tileFailures.paused(currentProvider) || tileFailures.blocked(currentProvider, x, static_cast<uint32_t>(y), zoom))
         {
-            tilePointers.push_back(job->tile->buffer); // reuse buffer from already queued job
+            ++statBackedOff;
+            tilePointers.push_back(nullptr);
             continue;
         }
 
-        CachedTile *tileToReplace = findUnusedTile(requiredTiles, zoom);
+        // Tiles that are not kept never take a cache slot, so a one-shot map does not evict cached tiles
+        const bool keepTile = !directDecode || cacheDirectTiles || overscanMargin;
+        if (!keepTile)
+            tileToReplace = nullptr;
+        else if (!tileToReplace)
+            tileToReplace = findUnusedTile();
+
+        ++cacheStats.misses;
         if (!tileToReplace)
         {
-            log_e("Cache error, no unused tile found, could not store tile %lu, %i, %u", x, y, zoom);
             tilePointers.push_back(nullptr); // again, keep 1:1 aligned
+            if (directDecode)
+            {
+                // One job draws every map position of a tile that shows up more than once
+                const bool queued = std::any_of(jobs.begin(), jobs.end(), [&](const TileJob &job)
+                                                { return job.x == x && job.y == static_cast<uint32_t>(y); });
+                if (!queued)
+                {
+                    jobs.push_back({x, static_cast<uint32_t>(y), zoom, nullptr, false, mapGeneration.load()}); // decoded straight into the map only
+                    priorities.push_back(tilePriority(tileIndex, zoom));
+                }
+                continue;
+            }
+            log_e("Cache error, no unused tile found, could not store tile %lu, %i, %u", x, y, zoom);
+            continue;
+        }
+
+        if (!assignTile(*tileToReplace, x, static_cast<uint32_t>(y), zoom, part))
+        {
+            tilePointers.push_back(nullptr);
             continue;
         }
 
-        tilePointers.push_back(tileToReplace->buffer);                      // store buffer for rendering
-        jobs.push_back({x, static_cast<uint32_t>(y), zoom, tileToReplace}); // queue job
+        tilePointers.push_back(tileToReplace);                                                           // store tile for rendering
+        jobs.push_back({x, static_cast<uint32_t>(y), zoom, tileToReplace, false, mapGeneration.load()}); // queue job
+        priorities.push_back(tilePriority(tileIndex, zoom));
+    }
+
+    sortJobs(jobs, priorities);
+}
+
+float OpenStreetMap::tilePriority(size_t tileIndex, uint8_t zoom)
+{
+    const int tileSize = currentProvider->tileSize;
+    const MapRect rect = {static_cast<int16_t>(startOffsetX + (tileIndex % numberOfColums) * tileSize),
+                          static_cast<int16_t>(startOffsetY + (tileIndex / numberOfColums) * tileSize),
+                          static_cast<uint16_t>(tileSize), static_cast<uint16_t>(tileSize)};
+
+    float focusX = mapWidth / 2.0f;
+    float focusY = mapHeight / 2.0f;
+    if (focusSet)
+    {
+        focusX = lon2tile(focusLongitude, zoom) * tileSize - mapLeft();
+        focusY = lat2tile(focusLatitude, zoom) * tileSize - mapTop();
     }
+
+    // Distance from the focus point to the nearest pixel of the tile, 0 for the tile under it
+    const float dx = std::max({rect.x - focusX, 0.0f, focusX - (rect.x + rect.w)});
+    const float dy = std::max({rect.y - focusY, 0.0f, focusY - (rect.y + rect.h)});
+    const float distance = sqrtf(dx * dx + dy * dy);
+
+    // Called with cacheMutex held, the callback is documented not to use the map
+    const float weight = tileWeight ? tileWeight(rect) : 1.0f;
+    if (weight <= 0)
+        return FLT_MAX;
+    return distance / weight;
+}
+
+void OpenStreetMap::sortJobs(std::vector<TileJob> &jobs, const std::vector<float> &priorities)
+{
+    // Jobs are queued most important first, so a map timeout drops the least important tiles
+    std::vector<size_t> order(jobs.size());
+    std::iota(order.begin(), order.end(), 0);
+    std::stable_sort(order.begin(), order.end(), [&priorities](size_t a, size_t b)
+                     { return priorities[a] < priorities[b]; });
+
+    std::vector<TileJob> sorted;
+    sorted.reserve(jobs.size());
+    for (const size_t index : order)
+        sorted.push_back(jobs[index]);
+    jobs.swap(sorted);
 }
 
 void OpenStreetMap::runJobs(const std::vector<TileJob> &jobs)
 {
     log_d("submitting %i jobs", (int)jobs.size());
 
-    pendingJobs.store(jobs.size());
+    // Called with cacheMutex held, so no worker can finish a job before it is accounted for
     startJobsMS = millis();
+
     for (const TileJob &job : jobs)
+    {
         if (xQueueSend(jobQueue, &job, 0) != pdPASS)
         {
             log_e("Failed to enqueue TileJob");
-            --pendingJobs;
+            invalidateTile(job.tile);
+            continue;
         }
+        addPendingJob();
+        xSemaphoreGive(jobSignal);
+    }
+}
 
-    while (pendingJobs.load() > 0)
-        vTaskDelay(pdMS_TO_TICKS(1));
+void OpenStreetMap::addPendingJob()
+{
+    if (++pendingJobs == 1)
+        xEventGroupClearBits(jobEvents, OSM_JOBS_DONE_BIT);
 }
 
-bool OpenStreetMap::composeMap(LGFX_Sprite &mapSprite, TileBufferList &tilePointers)
+void OpenStreetMap::planPrefetch()
 {
-    if (mapSprite.width() != mapWidth || mapSprite.height() != mapHeight)
+    // Called with cacheMutex held after the map jobs are queued, so prefetches only take spare slots
+    if (!motionHint || hintSpeed <= 0 || !prefetchQueue || mapTiles.empty())
+        return;
+
+    tileList candidates;
+    const double headingRad = hintHeading * M_PI / 180.0;
+    const double metersPerLonDegree = OSM_METERS_PER_DEGREE * std::max(cos(hintLatitude * M_PI / 180.0), 0.01);
+    for (int step = 1; step <= OSM_PREFETCH_STEPS; ++step)
     {
-        mapSprite.deleteSprite();
-        mapSprite.setPsram(true);
-        mapSprite.setColorDepth(lgfx::rgb565_2Byte);
-        mapSprite.createSprite(mapWidth, mapHeight);
-        if (!mapSprite.getBuffer())
-        {
-            log_e("could not allocate map");
-            return false;
-        }
+        const double distance = hintSpeed * OSM_PREFETCH_LOOKAHEAD_S * step / OSM_PREFETCH_STEPS;
+        const double latitude = hintLatitude + distance * cos(headingRad) / OSM_METERS_PER_DEGREE;
+        const double longitude = hintLongitude + distance * sin(headingRad) / metersPerLonDegree;
+        predictViewport(longitude, latitude, mapZoom, candidates);
     }
 
-    for (size_t tileIndex = 0; tileIndex < tilePointers.size(); ++tileIndex)
+    const int tileSize = currentProvider->tileSize;
+    const MapRect fullTile = {0, 0, static_cast<uint16_t>(tileSize), static_cast<uint16_t>(tileSize)};
+    for (const auto &[x, y] : candidates)
     {
-        const int drawX = startOffsetX + (tileIndex % numberOfColums) * currentProvider->tileSize;
-        const int drawY = startOffsetY + (tileIndex / numberOfColums) * currentProvider->tileSize;
-        const uint16_t *tile = tilePointers[tileIndex];
+        if (!uxQueueSpacesAvailable(prefetchQueue))
+            break;
+
+        const int slot = tilesIndex.find(TileCacheIndex::makeKey(x, y, mapZoom));
+        if (slot >= 0 && (tilesCache[slot].valid || tilesCache[slot].busy))
+            continue; // cached, on the map or already queued
+
+        if (tileFailures.paused(currentProvider))
+            break;
+        if (tileFailures.blocked(currentProvider, x, static_cast<uint32_t>(y), mapZoom))
+            continue;
+
+        // A prefetch never evicts a cached tile
+        CachedTile *tile = (slot >= 0) ? &tilesCache[slot] : findSpareTile();
         if (!tile)
+            break; // no spare slots left
+
+        if (!assignTile(*tile, x, static_cast<uint32_t>(y), mapZoom, fullTile))
+            break;
+
+        tile->prefetching = true;
+        const TileJob job = {x, static_cast<uint32_t>(y), mapZoom, tile, true, mapGeneration.load()};
+        if (xQueueSend(prefetchQueue, &job, 0) != pdPASS)
         {
-            mapSprite.fillRect(drawX, drawY, currentProvider->tileSize, currentProvider->tileSize, OSM_BGCOLOR);
-            continue;
+            tile->prefetching = false;
+            invalidateTile(tile);
+            break;
         }
-        mapSprite.pushImage(drawX, drawY, currentProvider->tileSize, currentProvider->tileSize, tile);
+        ++prefetchJobs;
+        ++prefetchStats.requested;
+        xSemaphoreGive(jobSignal);
     }
-
-    mapSprite.setTextColor(TFT_WHITE, OSM_BGCOLOR);
-    mapSprite.drawRightString(currentProvider->attribution, mapSprite.width(), mapSprite.height() - 10, &DejaVu9Modded);
-    mapSprite.setTextColor(TFT_WHITE, TFT_BLACK);
-    return true;
 }
 
-bool OpenStreetMap::fetchMap(LGFX_Sprite &mapSprite, double longitude, double latitude, uint8_t zoom, unsigned long timeoutMS)
+void OpenStreetMap::predictViewport(double longitude, double latitude, uint8_t zoom, tileList &tiles)
 {
-    if (!tasksStarted && !startTileWorkerTasks())
+    constexpr double MAX_MERCATOR_LAT = 85.0;
+    longitude = fmod(fmod(longitude + 180.0, 360.0) + 360.0, 360.0) - 180.0;
+    latitude = std::clamp(latitude, -MAX_MERCATOR_LAT, MAX_MERCATOR_LAT);
+
+    const int tileSize = currentProvider->tileSize;
+    const int32_t worldTileWidth = 1 << zoom;
+    const double left = lon2tile(longitude, zoom) * tileSize - mapWidth / 2.0;
+    const double top = lat2tile(latitude, zoom) * tileSize - mapHeight / 2.0;
+    const int32_t firstX = floor(left / tileSize);
+    const int32_t lastX = floor((left + mapWidth - 1) / tileSize);
+    const int32_t firstY = std::max<int32_t>(floor(top / tileSize), 0);
+    const int32_t lastY = std::min<int32_t>(floor((top + mapHeight - 1) / tileSize), worldTileWidth - 1);
+
+    for (int32_t y = firstY; y <= lastY; ++y)
     {
-        log_e("Failed to start tile worker(s)");
-        return false;
+        for (int32_t x = firstX; x <= lastX; ++x)
+        {
+            const uint32_t tileX = (x % worldTileWidth + worldTileWidth) % worldTileWidth;
+            if (std::find(tiles.begin(), tiles.end(), std::make_pair(tileX, y)) == tiles.end())
+                tiles.emplace_back(tileX, y);
+        }
     }
+}
 
-    if (zoom < currentProvider->minZoom || zoom > currentProvider->maxZoom)
+void OpenStreetMap::dropPrefetchJobs()
+{
+    // Called with cacheMutex held, jobs already taken by a worker run to completion
+    if (!prefetchQueue)
+        return;
+
+    TileJob job;
+    while (xQueueReceive(prefetchQueue, &job, 0) == pdPASS)
     {
-        log_e("Invalid zoom level: %d", zoom);
-        return false;
+        xSemaphoreTake(jobSignal, 0);
+        job.tile->prefetching = false;
+        job.tile->neededFrame = 0;
+        invalidateTile(job.tile);
+        --prefetchJobs;
+        ++prefetchStats.dropped;
     }
+}
 
-    if (!mapWidth || !mapHeight)
+bool OpenStreetMap::lockWhenIdle()
+{
+    // On success cacheMutex stays held, so no map can start or finish composing until unlockCache()
+    if (!cacheMutex)
+        return true; // no workers were ever started
+
+    xSemaphoreTake(cacheMutex, portMAX_DELAY);
+    dropPrefetchJobs();
+    if (pendingJobs.load() == 0 && prefetchJobs.load() == 0)
+        return true;
+    xSemaphoreGive(cacheMutex);
+    return false;
+}
+
+void OpenStreetMap::unlockCache()
+{
+    if (cacheMutex)
+        xSemaphoreGive(cacheMutex);
+}
+
+void OpenStreetMap::setMotionHint(double longitude, double latitude, float headingDeg, float speedMS)
+{
+    if (cacheMutex)
+        xSemaphoreTake(cacheMutex, portMAX_DELAY);
+
+    motionHint = true;
+    hintLongitude = longitude;
+    hintLatitude = latitude;
+    hintHeading = headingDeg;
+    hintSpeed = speedMS;
+
+    // Between maps the new prediction replaces the queued one, otherwise the next map plans it
+    if (cacheMutex && pendingJobs.load() == 0)
     {
-        log_e("Invalid map dimension");
-        return false;
+        dropPrefetchJobs();
+        planPrefetch();
     }
 
-    if (!tilesCache.capacity() && !resizeTilesCache(tilesNeeded(mapWidth, mapHeight)))
+    if (cacheMutex)
+        xSemaphoreGive(cacheMutex);
+}
+
+void OpenStreetMap::addPositionHint(double longitude, double latitude)
+{
+    if (positionCount == OSM_PREFETCH_HISTORY)
     {
-        log_e("Could not allocate tile cache");
-        return false;
+        std::move(positionHistory + 1, positionHistory + OSM_PREFETCH_HISTORY, positionHistory);
+        --positionCount;
     }
+    positionHistory[positionCount++] = {longitude, latitude, millis()};
+    if (positionCount < 2)
+        return;
 
-    // Web Mercator projection only supports latitudes up to ~85.0511°.
-    // See https://en.wikipedia.org/wiki/Web_Mercator_projection#Formulas
-    // We use 85.0° as a safe and simple boundary.
-    constexpr double MAX_MERCATOR_LAT = 85.0;
+    const PositionHint &oldest = positionHistory[0];
+    const PositionHint &newest = positionHistory[positionCount - 1];
+    const float seconds = (newest.timeMS - oldest.timeMS) / 1000.0f;
+    if (seconds <= 0)
+        return;
 
-    longitude = fmod(longitude + 180.0, 360.0) - 180.0;
-    latitude = std::clamp(latitude, -MAX_MERCATOR_LAT, MAX_MERCATOR_LAT);
+    const double deltaLon = fmod(newest.longitude - oldest.longitude + 540.0, 360.0) - 180.0;
+    const double north = (newest.latitude - oldest.latitude) * OSM_METERS_PER_DEGREE;
+    const double east = deltaLon * OSM_METERS_PER_DEGREE * cos(newest.latitude * M_PI / 180.0);
+    const float heading = atan2(east, north) * 180.0 / M_PI;
+    setMotionHint(newest.longitude, newest.latitude, heading, sqrt(north * north + east * east) / seconds);
+}
 
-    tileList requiredTiles;
-    computeRequiredTiles(longitude, latitude, zoom, requiredTiles);
+void OpenStreetMap::clearMotionHint()
+{
+    if (cacheMutex)
+        xSemaphoreTake(cacheMutex, portMAX_DELAY);
+    motionHint = false;
+    positionCount = 0;
+    dropPrefetchJobs();
+    if (cacheMutex)
+        xSemaphoreGive(cacheMutex);
+}
+
+void OpenStreetMap::setFocusPoint(double longitude, double latitude)
+{
+    if (cacheMutex)
+        xSemaphoreTake(cacheMutex, portMAX_DELAY);
+    focusSet = true;
+    focusLongitude = longitude;
+    focusLatitude = latitude;
+    if (cacheMutex)
+        xSemaphoreGive(cacheMutex);
+}
+
+void OpenStreetMap::clearFocusPoint()
+{
+    if (cacheMutex)
+        xSemaphoreTake(cacheMutex, portMAX_DELAY);
+    focusSet = false;
+    if (cacheMutex)
+        xSemaphoreGive(cacheMutex);
+}
+
+CacheStats OpenStreetMap::getCacheStats() const
+{
+    if (cacheMutex)
+        xSemaphoreTake(cacheMutex, portMAX_DELAY);
+    const CacheStats stats = cacheStats;
+    if (cacheMutex)
+        xSemaphoreGive(cacheMutex);
+    return stats;
+}
+
+void OpenStreetMap::resetCacheStats()
+{
+    if (cacheMutex)
+        xSemaphoreTake(cacheMutex, portMAX_DELAY);
+    cacheStats = {};
+    if (cacheMutex)
+        xSemaphoreGive(cacheMutex);
+}
+
+PrefetchStats OpenStreetMap::getPrefetchStats()
+{
+    if (cacheMutex)
+        xSemaphoreTake(cacheMutex, portMAX_DELAY);
+    const PrefetchStats stats = prefetchStats;
+    if (cacheMutex)
+        xSemaphoreGive(cacheMutex);
+    return stats;
+}
+
+void OpenStreetMap::resetPrefetchStats()
+{
+    if (cacheMutex)
+        xSemaphoreTake(cacheMutex, portMAX_DELAY);
+    prefetchStats = {};
+    if (cacheMutex)
+        xSemaphoreGive(cacheMutex);
+}
+
+void OpenStreetMap::setTileWeights(TileWeightCallback weight)
+{
+    if (cacheMutex)
+        xSemaphoreTake(cacheMutex, portMAX_DELAY);
+    tileWeight = weight;
+    if (cacheMutex)
+        xSemaphoreGive(cacheMutex);
+}
+
+void OpenStreetMap::prepareDecode(const TileJob &job, DecodeContext &context)
+{
+    context.tileSize = currentProvider->tileSize;
+    context.mapBuffer = nullptr;
+    context.targets.clear();
+
+    xSemaphoreTake(cacheMutex, portMAX_DELAY);
+    context.startMS = startJobsMS;
+    context.budgetMS = job.prefetch ? 0 : mapTimeoutMS;
+    context.cutOff = false;
+    const bool keepTile = job.prefetch || !directDecode || cacheDirectTiles || overscanMargin;
+    context.tileBuffer = (job.tile && keepTile) ? job.tile->buffer : nullptr;
+    if (context.tileBuffer)
+        context.crop = {static_cast<int16_t>(job.tile->cropX), static_cast<int16_t>(job.tile->cropY), job.tile->cropW, job.tile->cropH};
+    if (context.tileBuffer && job.tile->isCropped(context.tileSize) && !context.lineBuffer)
+        context.tileBuffer = nullptr; // cropping needs the scratch row
+
+    if (directDecode && progressiveSprite && job.z == mapZoom && !job.prefetch)
+    {
+        context.mapBuffer = static_cast<uint16_t *>(progressiveSprite->getBuffer());
+        context.mapWidth = mapWidth;
+        context.mapHeight = mapHeight;
+        context.generation = mapGeneration.load();
+        for (size_t tileIndex = 0; tileIndex < mapTiles.size(); ++tileIndex)
+        {
+            if (mapTiles[tileIndex].first != job.x || mapTiles[tileIndex].second != static_cast<int32_t>(job.y))
+                continue;
+            context.targets.emplace_back(startOffsetX + (tileIndex % numberOfColums) * currentProvider->tileSize,
+                                         startOffsetY + (tileIndex / numberOfColums) * currentProvider->tileSize);
+        }
+    }
+    xSemaphoreGive(cacheMutex);
+}
+
+void OpenStreetMap::finishJob(const TileJob &job, bool success, const DecodeContext *context)
+{
+    uint32_t requestId = 0;
+    MapReadyCallback onReady;
+    bool composed = false;
+    std::vector<MapRect> drawn;
+
+    xSemaphoreTake(cacheMutex, portMAX_DELAY);
+    const bool cached = success && job.tile && context && context->tileBuffer;
+
+    // A prefetch only counts as a map job once a map needed its tile
+    bool counted = true;
+    if (job.prefetch)
+    {
+        counted = !job.tile->prefetching;
+        job.tile->prefetching = false;
+        job.tile->prefetched = cached && !counted;
+        --prefetchJobs;
+        if (cached)
+            ++prefetchStats.completed;
+        else
+            ++prefetchStats.failed;
+    }
+
+    if (cached)
+    {
+        job.tile->valid = true;
+        job.tile->busy = false;
+    }
+    else
+        invalidateTile(job.tile);
+    if (success)
+        tileFailures.forget(currentProvider, job.x, job.y, job.z);
+
+    if (counted && success && progressiveSprite)
+    {
+        const bool pixelsDone = context && context->mapBuffer && context->generation == leasedGeneration;
+        drawTileProgressive(job, cached ? job.tile : nullptr, pixelsDone, drawn);
+    }
+
+    if (counted && --pendingJobs == 0)
+    {
+        log_i("Finished all jobs in %lu ms", millis() - startJobsMS);
+        xEventGroupSetBits(jobEvents, OSM_JOBS_DONE_BIT);
+
+        LGFX_Sprite *sprite = asyncSprite;
+        takeAsyncRequest(requestId, onReady);
+        if (sprite)
+            composed = finishMap(*sprite, drawn);
+    }
+    xSemaphoreGive(cacheMutex);
+
+    notifyDrawn(drawn);
+
+    // Run the callback without holding the mutex so it may start a new request with fetchMapAsync
+    if (onReady)
+        onReady(requestId, composed);
+}
+
+void OpenStreetMap::takeAsyncRequest(uint32_t &requestId, MapReadyCallback &onReady)
+{
+    requestId = asyncRequestId;
+    onReady = std::move(asyncCallback);
+    asyncCallback = nullptr;
+    asyncRequestId = 0;
+    asyncSprite = nullptr;
+}
+
+bool OpenStreetMap::allocateMap(LGFX_Sprite &mapSprite, uint16_t width, uint16_t height)
+{
+    if (mapSprite.width() != width || mapSprite.height() != height)
+    {
+        mapSprite.deleteSprite();
+        mapSprite.setPsram(true);
+        mapSprite.setColorDepth(lgfx::rgb565_2Byte);
+        mapSprite.createSprite(width, height);
+        if (!mapSprite.getBuffer())
+        {
+            log_e("could not allocate map");
+            return false;
+        }
+    }
+    return true;
+}
+
+void OpenStreetMap::drawCachedTile(LGFX_Sprite &mapSprite, const CachedTile &tile, int drawX, int drawY)
+{
+    const int tileSize = currentProvider->tileSize;
+    if (!tile.isCropped(tileSize))
+    {
+        mapSprite.pushImage(drawX, drawY, tileSize, tileSize, tile.buffer);
+        return;
+    }
+
+    mapSprite.fillRect(drawX, drawY, tileSize, tileSize, OSM_BGCOLOR);
+    mapSprite.pushImage(drawX + tile.cropX, drawY + tile.cropY, tile.cropW, tile.cropH, tile.buffer);
+}
+
+void OpenStreetMap::drawMissingTile(LGFX_Sprite &mapSprite, size_t tileIndex, int drawX, int drawY)
+{
+    // Show a scaled copy from another zoom level until the tile itself is available
+    const auto &[x, y] = mapTiles[tileIndex];
+    if (y >= 0 && y < (1 << mapZoom))
+    {
+        for (int levels = 1; levels <= OSM_FALLBACK_PARENT_LEVELS && levels <= mapZoom; ++levels)
+            if (drawParentTile(mapSprite, x, y, levels, drawX, drawY))
+                return;
+
+        if (drawChildTiles(mapSprite, x, y, drawX, drawY))
+            return;
+    }
+    mapSprite.fillRect(drawX, drawY, currentProvider->tileSize, currentProvider->tileSize, OSM_BGCOLOR);
+}
+
+bool OpenStreetMap::drawParentTile(LGFX_Sprite &mapSprite, uint32_t x, uint32_t y, int levels, int drawX, int drawY)
+{
+    CachedTile *parent = isTileCached(x >> levels, y >> levels, mapZoom - levels);
+    if (!parent)
+        return false;
+
+    // The parent covers this tile with a square of tileSize / scale pixels
+    const int tileSize = currentProvider->tileSize;
+    const int scale = 1 << levels;
+    const int size = tileSize / scale;
+    const int srcX = (x & (scale - 1)) * size;
+    const int srcY = (y & (scale - 1)) * size;
+    if (!parent->covers(srcX, srcY, size, size))
+        return false;
+
+    touchTile(*parent);
+
+    const int left = std::max(0, -drawX);
+    const int top = std::max(0, -drawY);
+    const int right = std::min(tileSize, mapWidth - drawX);
+    const int bottom = std::min(tileSize, mapHeight - drawY);
+    uint16_t *map = static_cast<uint16_t *>(mapSprite.getBuffer());
+    for (int row = top; row < bottom; ++row)
+    {
+        uint16_t *dest = map + (drawY + row) * mapWidth + drawX;
+        if (row > top && row % scale)
+        {
+            memcpy(dest + left, dest - mapWidth + left, (right - left) * sizeof(uint16_t)); // same source row
+            continue;
+        }
+
+        const uint16_t *src = parent->buffer + (srcY + row / scale - parent->cropY) * parent->cropW + (srcX - parent->cropX);
+        for (int col = left; col < right; ++col)
+            dest[col] = src[col / scale];
+    }
+    return true;
+}
+
+bool OpenStreetMap::drawChildTiles(LGFX_Sprite &mapSprite, uint32_t x, uint32_t y, int drawX, int drawY)
+{
+    const int tileSize = currentProvider->tileSize;
+    CachedTile *children[4] = {};
+    bool found = false;
+    for (int child = 0; child < 4; ++child)
+    {
+        CachedTile *tile = isTileCached(x * 2 + (child & 1), y * 2 + (child >> 1), mapZoom + 1);
+        if (tile && !tile->isCropped(tileSize))
+        {
+            children[child] = tile;
+            found = true;
+        }
+    }
+    if (!found)
+        return false;
+
+    mapSprite.fillRect(drawX, drawY, tileSize, tileSize, OSM_BGCOLOR); // for missing children
+
+    // Each child shrinks to a quarter with a 2x2 box filter
+    const int half = tileSize / 2;
+    uint16_t *map = static_cast<uint16_t *>(mapSprite.getBuffer());
+    for (int child = 0; child < 4; ++child)
+    {
+        CachedTile *tile = children[child];
+        if (!tile)
+            continue;
+
+        touchTile(*tile);
+        const int childX = drawX + (child & 1) * half;
+        const int childY = drawY + (child >> 1) * half;
+        const int left = std::max(0, -childX);
+        const int top = std::max(0, -childY);
+        const int right = std::min(half, mapWidth - childX);
+        const int bottom = std::min(half, mapHeight - childY);
+        for (int row = top; row < bottom; ++row)
+        {
+            uint16_t *dest = map + (childY + row) * mapWidth + childX;
+            const uint16_t *src = tile->buffer + row * 2 * tileSize;
+            for (int col = left; col < right; ++col)
+                dest[col] = averagePixels(src[col * 2], src[col * 2 + 1], src[tileSize + col * 2], src[tileSize + col * 2 + 1]);
+        }
+    }
+    return true;
+}
+
+uint16_t OpenStreetMap::averagePixels(uint16_t a, uint16_t b, uint16_t c, uint16_t d)
+{
+    // Pixels are rgb565 big endian like the sprite
+    uint32_t red = 0, green = 0, blue = 0;
+    for (uint16_t pixel : {a, b, c, d})
+    {
+        pixel = __builtin_bswap16(pixel);
+        red += pixel >> 11;
+        green += (pixel >> 5) & 0x3f;
+        blue += pixel & 0x1f;
+    }
+    return __builtin_bswap16(((red / 4) << 11) | ((green / 4) << 5) | (blue / 4));
+}
+
+bool OpenStreetMap::composeMap(LGFX_Sprite &mapSprite, CachedTileList &tilePointers)
+{
+    if (!allocateMap(mapSprite, mapWidth, mapHeight))
+        return false;
+
+    // The backing map only gets an attribution in the window that is shown
+    const bool backing = &mapSprite == &backingMap;
+    std::vector<MapRect> unused;
+    if (incrementalPan && panMap(mapSprite, tilePointers))
+    {
+        if (backing)
+        {
+            backingLeft = mapLeft();
+            backingTop = mapTop();
+        }
+        else
+            drawAttribution(mapSprite, unused);
+        return true;
+    }
+
+    bool complete = true;
+    for (size_t tileIndex = 0; tileIndex < tilePointers.size(); ++tileIndex)
+    {
+        const int drawX = startOffsetX + (tileIndex % numberOfColums) * currentProvider->tileSize;
+        const int drawY = startOffsetY + (tileIndex / numberOfColums) * currentProvider->tileSize;
+        const CachedTile *tile = tilePointers[tileIndex];
+        if (!tile || !tile->buffer || !tile->valid)
+        {
+            complete = false;
+            drawMissingTile(mapSprite, tileIndex, drawX, drawY);
+            continue;
+        }
+        drawCachedTile(mapSprite, *tile, drawX, drawY);
+    }
+
+    // Only a map without stand-ins is worth scrolling later
+    panSprite = complete ? &mapSprite : nullptr;
+    panZoom = mapZoom;
+    panWidth = mapWidth;
+    panHeight = mapHeight;
+    panLeft = mapLeft();
+    panTop = mapTop();
+
+    if (backing)
+    {
+        backingReady = true;
+        backingComplete = complete;
+        backingZoom = mapZoom;
+        backingLeft = mapLeft();
+        backingTop = mapTop();
+        return true;
+    }
+
+    drawAttribution(mapSprite, unused);
+    return true;
+}
+
+bool OpenStreetMap::panMap(LGFX_Sprite &mapSprite, CachedTileList &tilePointers)
+{
+    // Called with cacheMutex held, reuses the pixels of the previous map when only its position changed
+    if (panSprite != &mapSprite || panZoom != mapZoom || panWidth != mapWidth || panHeight != mapHeight)
+        return false;
+
+    for (size_t tileIndex = 0; tileIndex < tilePointers.size(); ++tileIndex)
+    {
+        const CachedTile *tile = tilePointers[tileIndex];
+        const int32_t y = mapTiles[tileIndex].second;
+        const bool outsideWorld = y < 0 || y >= (1 << mapZoom);
+        if (!outsideWorld && (!tile || !tile->buffer || !tile->valid))
+            return false; // the exposed strips could need a stand-in, redraw everything
+    }
+
+    const int64_t worldSize = static_cast<int64_t>(currentProvider->tileSize) << mapZoom;
+    int64_t dx = ((mapLeft() - panLeft) % worldSize + worldSize) % worldSize;
+    if (dx >= worldSize / 2)
+        dx -= worldSize;
+    const int64_t dy = mapTop() - panTop;
+    if (std::abs(dx) >= mapWidth || std::abs(dy) >= mapHeight)
+        return false;
+
+    // One move shifts both directions, pixels wrapping around a row end up in the exposed column strip
+    uint16_t *map = static_cast<uint16_t *>(mapSprite.getBuffer());
+    const int64_t shift = dy * mapWidth + dx;
+    const int64_t pixels = static_cast<int64_t>(mapWidth) * mapHeight;
+    if (shift > 0)
+        memmove(map, map + shift, (pixels - shift) * sizeof(uint16_t));
+    else if (shift < 0)
+        memmove(map - shift, map, (pixels + shift) * sizeof(uint16_t));
+
+    const int width = mapWidth;
+    const int height = mapHeight;
+    const int columns = std::abs(dx);
+    const int rows = std::abs(dy);
+    if (dx)
+        composeRect(mapSprite, tilePointers, {static_cast<int16_t>(dx > 0 ? width - columns : 0), 0, static_cast<uint16_t>(columns), static_cast<uint16_t>(height)});
+    if (dy)
+        composeRect(mapSprite, tilePointers, {0, static_cast<int16_t>(dy > 0 ? height - rows : 0), static_cast<uint16_t>(width), static_cast<uint16_t>(rows)});
+
+    // The previous attribution moved with the pixels
+    const int bandTop = std::max<int>(height - OSM_ATTRIBUTION_HEIGHT - dy, 0);
+    const int bandBottom = std::min<int>(height - dy, height);
+    if (bandBottom > bandTop)
+        composeRect(mapSprite, tilePointers, {0, static_cast<int16_t>(bandTop), static_cast<uint16_t>(width), static_cast<uint16_t>(bandBottom - bandTop)});
+
+    log_d("panned map by %d,%d pixels", static_cast<int>(dx), static_cast<int>(dy));
+    panLeft = mapLeft();
+    panTop = mapTop();
+    return true;
+}
+
+void OpenStreetMap::composeRect(LGFX_Sprite &mapSprite, CachedTileList &tilePointers, const MapRect &rect)
+{
+    const int tileSize = currentProvider->tileSize;
+    mapSprite.setClipRect(rect.x, rect.y, rect.w, rect.h);
+    for (size_t tileIndex = 0; tileIndex < tilePointers.size(); ++tileIndex)
+    {
+        const int drawX = startOffsetX + (tileIndex % numberOfColums) * tileSize;
+        const int drawY = startOffsetY + (tileIndex / numberOfColums) * tileSize;
+        if (drawX >= rect.x + rect.w || drawX + tileSize <= rect.x || drawY >= rect.y + rect.h || drawY + tileSize <= rect.y)
+            continue;
+
+        const CachedTile *tile = tilePointers[tileIndex];
+        if (!tile)
+            mapSprite.fillRect(drawX, drawY, tileSize, tileSize, OSM_BGCOLOR);
+        else
+            drawCachedTile(mapSprite, *tile, drawX, drawY);
+    }
+    mapSprite.clearClipRect();
+}
+
+int64_t OpenStreetMap::mapLeft() const
+{
+    return static_cast<int64_t>(startTileIndexX) * currentProvider->tileSize - startOffsetX;
+}
+
+int64_t OpenStreetMap::mapTop() const
+{
+    return static_cast<int64_t>(startTileIndexY) * currentProvider->tileSize - startOffsetY;
+}
+
+bool OpenStreetMap::composeProgressiveMap(LGFX_Sprite &mapSprite, CachedTileList &tilePointers, std::vector<MapRect> &drawn)
+{
+    // Called with cacheMutex held, draws what is cached now and leaves the rest to the workers
+    if (!allocateMap(mapSprite, mapWidth, mapHeight))
+        return false;
+
+    for (size_t tileIndex = 0; tileIndex < tilePointers.size(); ++tileIndex)
+    {
+        const int drawX = startOffsetX + (tileIndex % numberOfColums) * currentProvider->tileSize;
+        const int drawY = startOffsetY + (tileIndex / numberOfColums) * currentProvider->tileSize;
+        const CachedTile *tile = tilePointers[tileIndex];
+        if (!tile || !tile->buffer || !tile->valid)
+        {
+            drawMissingTile(mapSprite, tileIndex, drawX, drawY);
+            continue;
+        }
+        drawCachedTile(mapSprite, *tile, drawX, drawY);
+    }
+
+    progressiveSprite = &mapSprite;
+    panSprite = nullptr;
+    drawn.push_back({0, 0, mapWidth, mapHeight});
+    return true;
+}
+
+void OpenStreetMap::drawTileProgressive(const TileJob &job, const CachedTile *tile, bool pixelsDone, std::vector<MapRect> &drawn)
+{
+    if (job.z != mapZoom)
+        return;
+
+    // A tile can show up more than once when the map is wider than the world
+    for (size_t tileIndex = 0; tileIndex < mapTiles.size(); ++tileIndex)
+    {
+        if (mapTiles[tileIndex].first != job.x || mapTiles[tileIndex].second != static_cast<int32_t>(job.y))
+            continue;
+
+        const int drawX = startOffsetX + (tileIndex % numberOfColums) * currentProvider->tileSize;
+        const int drawY = startOffsetY + (tileIndex / numberOfColums) * currentProvider->tileSize;
+        if (!pixelsDone)
+        {
+            if (!tile)
+                continue;
+            drawCachedTile(*progressiveSprite, *tile, drawX, drawY);
+        }
+        clipRect(drawX, drawY, currentProvider->tileSize, drawn);
+    }
+}
+
+void OpenStreetMap::clipRect(int drawX, int drawY, int size, std::vector<MapRect> &drawn)
+{
+    const int left = std::max(drawX, 0);
+    const int top = std::max(drawY, 0);
+    const int right = std::min(drawX + size, static_cast<int>(mapWidth));
+    const int bottom = std::min(drawY + size, static_cast<int>(mapHeight));
+    if (right > left && bottom > top)
+        drawn.push_back({static_cast<int16_t>(left), static_cast<int16_t>(top),
+                         static_cast<uint16_t>(right - left), static_cast<uint16_t>(bottom - top)});
+}
+
+void OpenStreetMap::leaseMapSprite(uint32_t generation)
+{
+    // Waits for a row that is being written, after that only decoders of this generation write into the map
+    xSemaphoreTake(spriteMutex, portMAX_DELAY);
+    leasedGeneration = generation;
+    xSemaphoreGive(spriteMutex);
+}
+
+bool OpenStreetMap::finishMap(LGFX_Sprite &mapSprite, std::vector<MapRect> &drawn)
+{
+    // Called with cacheMutex held when all jobs are done or the map is given up on
+    leaseMapSprite(0);
+    if (progressiveSprite != &mapSprite)
+        return composeMap(mapSprite, tilePointers);
+
+    progressiveSprite = nullptr;
+    drawAttribution(mapSprite, drawn);
+    return true;
+}
+
+void OpenStreetMap::drawAttribution(LGFX_Sprite &mapSprite, std::vector<MapRect> &drawn)
+{
+    mapSprite.setTextColor(TFT_WHITE, OSM_BGCOLOR);
+    mapSprite.drawRightString(currentProvider->attribution, mapSprite.width(), mapSprite.height() - OSM_ATTRIBUTION_HEIGHT, &DejaVu9Modded);
+    mapSprite.setTextColor(TFT_WHITE, TFT_BLACK);
+    drawn.push_back({0, static_cast<int16_t>(mapSprite.height() - OSM_ATTRIBUTION_HEIGHT), static_cast<uint16_t>(mapSprite.width()), OSM_ATTRIBUTION_HEIGHT});
+}
+
+void OpenStreetMap::notifyDrawn(const std::vector<MapRect> &drawn)
+{
+    if (!tileDrawnCallback)
+        return;
+
+    for (const MapRect &rect : drawn)
+        tileDrawnCallback(rect);
+}
+
+void OpenStreetMap::setDirectDecode(bool enabled, bool cacheTiles)
+{
+    if (cacheMutex)
+        xSemaphoreTake(cacheMutex, portMAX_DELAY);
+    directDecode = enabled;
+    cacheDirectTiles = cacheTiles;
+    if (cacheMutex)
+        xSemaphoreGive(cacheMutex);
+}
+
+void OpenStreetMap::setIncrementalPan(bool enabled)
+{
+    if (cacheMutex)
+        xSemaphoreTake(cacheMutex, portMAX_DELAY);
+    incrementalPan = enabled;
+    panSprite = nullptr;
+    if (cacheMutex)
+        xSemaphoreGive(cacheMutex);
+}
+
+void OpenStreetMap::setProgressive(bool enabled, TileDrawnCallback onTileDrawn)
+{
+    if (cacheMutex)
+        xSemaphoreTake(cacheMutex, portMAX_DELAY);
+    progressiveMode = enabled;
+    tileDrawnCallback = enabled ? std::move(onTileDrawn) : nullptr;
+    if (cacheMutex)
+        xSemaphoreGive(cacheMutex);
+}
+
+bool OpenStreetMap::prepareMap(double &longitude, double &latitude, uint8_t zoom)
+{
+    if (!tasksStarted && !startTileWorkerTasks())
+    {
+        log_e("Failed to start tile worker(s)");
+        return false;
+    }
+
+    if (zoom < currentProvider->minZoom || zoom > currentProvider->maxZoom)
+    {
+        log_e("Invalid zoom level: %d", zoom);
+        return false;
+    }
+
+    if (!mapWidth || !mapHeight)
+    {
+        log_e("Invalid map dimension");
+        return false;
+    }
+
+    if (!tilesCache.capacity() && !resizeTilesCache(tilesNeeded(mapWidth, mapHeight)))
+    {
+        log_e("Could not allocate tile cache");
+        return false;
+    }
+
+    // Web Mercator projection only supports latitudes up to ~85.0511°.
+    // See https://en.wikipedia.org/wiki/Web_Mercator_projection#Formulas
+    // We use 85.0° as a safe and simple boundary.
+    constexpr double MAX_MERCATOR_LAT = 85.0;
+
+    longitude = fmod(longitude + 180.0, 360.0) - 180.0;
+    latitude = std::clamp(latitude, -MAX_MERCATOR_LAT, MAX_MERCATOR_LAT);
+    return true;
+}
+
+bool OpenStreetMap::planMap(LGFX_Sprite &mapSprite, double longitude, double latitude, uint8_t zoom, unsigned long timeoutMS, std::vector<MapRect> &drawn)
+{
+    // Called with cacheMutex held
+    tileList requiredTiles;
+    computeRequiredTiles(longitude, latitude, zoom, requiredTiles);
     if (tilesCache.capacity() < requiredTiles.size())
     {
-        log_e("Caching error: Need %i cache slots, but only %i are provided", requiredTiles.size(), tilesCache.capacity());
+        log_e("Caching error: Need %i cache slots, but only %i are provided", requiredTiles.size(), tilesCache.capacity());
+        return false;
+    }
+
+    mapTimeoutMS = timeoutMS;
+    tilePointers.clear();
+    progressiveSprite = nullptr;
+    leaseMapSprite(0);
+    ++mapGeneration;
+    dropPrefetchJobs();
+    updateCache(requiredTiles, zoom, tilePointers);
+    mapTiles.swap(requiredTiles);
+    mapZoom = zoom;
+    planPrefetch();
+
+    // Direct decoding needs the map allocated and drawn before the workers start writing into it
+    if ((progressiveMode || directDecode) && !overscanMargin && !composeProgressiveMap(mapSprite, tilePointers, drawn))
+        return false;
+    if (directDecode && !overscanMargin)
+        leaseMapSprite(mapGeneration.load());
+    return true;
+}
+
+bool OpenStreetMap::fetchMap(LGFX_Sprite &mapSprite, double longitude, double latitude, uint8_t zoom, unsigned long timeoutMS)
+{
+    // A callback runs on a map task, which would then wait for jobs only it can finish
+    if (onMapTask())
+    {
+        log_e("fetchMap can not be called from a map callback, use fetchMapAsync");
+        return false;
+    }
+
+    if (!prepareMap(longitude, latitude, zoom))
+        return false;
+
+    if (!overscanMargin)
+        return runMap(mapSprite, longitude, latitude, zoom, timeoutMS);
+
+    xSemaphoreTake(cacheMutex, portMAX_DELAY);
+    bool shown = showWindow(mapSprite, longitude, latitude, zoom, false);
+    xSemaphoreGive(cacheMutex);
+    if (shown)
+        return true;
+
+    // The view left the backing map, compose a new one around it
+    if (!runMap(backingMap, longitude, latitude, zoom, timeoutMS))
+        return false;
+
+    xSemaphoreTake(cacheMutex, portMAX_DELAY);
+    shown = showWindow(mapSprite, longitude, latitude, zoom, true);
+    xSemaphoreGive(cacheMutex);
+    return shown;
+}
+
+bool OpenStreetMap::showWindow(LGFX_Sprite &viewSprite, double longitude, double latitude, uint8_t zoom, bool anyBacking)
+{
+    // Called with cacheMutex held, a backing map with missing tiles is only shown right after composing it
+    if (!backingReady || (!backingComplete && !anyBacking) || backingZoom != zoom)
+        return false;
+
+    const int tileSize = currentProvider->tileSize;
+    const int64_t worldSize = static_cast<int64_t>(tileSize) << zoom;
+    const int64_t viewLeft = static_cast<int64_t>(floor(lon2tile(longitude, zoom) * tileSize)) - viewWidth / 2;
+    const int64_t viewTop = static_cast<int64_t>(floor(lat2tile(latitude, zoom) * tileSize)) - viewHeight / 2;
+    int64_t offsetX = ((viewLeft - backingLeft) % worldSize + worldSize) % worldSize;
+    if (offsetX >= worldSize / 2)
+        offsetX -= worldSize;
+    const int64_t offsetY = viewTop - backingTop;
+    if (offsetX < 0 || offsetY < 0 || offsetX + viewWidth > mapWidth || offsetY + viewHeight > mapHeight)
+        return false;
+
+    if (!allocateMap(viewSprite, viewWidth, viewHeight))
+        return false;
+
+    const uint16_t *backing = static_cast<const uint16_t *>(backingMap.getBuffer());
+    uint16_t *view = static_cast<uint16_t *>(viewSprite.getBuffer());
+    for (int row = 0; row < viewHeight; ++row)
+        memcpy(view + row * viewWidth, backing + (offsetY + row) * mapWidth + offsetX, viewWidth * sizeof(uint16_t));
+
+    std::vector<MapRect> unused;
+    drawAttribution(viewSprite, unused);
+
+    // Recenter the backing map in the background before the view reaches its edge
+    const int64_t edge = overscanMargin / 2;
+    if (offsetX < edge || offsetY < edge || mapWidth - offsetX - viewWidth < edge || mapHeight - offsetY - viewHeight < edge)
+        refillBacking(longitude, latitude, zoom);
+    return true;
+}
+
+void OpenStreetMap::refillBacking(double longitude, double latitude, uint8_t zoom)
+{
+    // Called with cacheMutex held, composes like an async request without a callback
+    if (pendingJobs.load() > 0 || asyncSprite)
+        return;
+
+    std::vector<MapRect> unused;
+    if (!planMap(backingMap, longitude, latitude, zoom, 0, unused))
+        return;
+
+    if (pendingJobs.load() == 0)
+        finishMap(backingMap, unused);
+    else
+        asyncSprite = &backingMap;
+}
+
+bool OpenStreetMap::runMap(LGFX_Sprite &mapSprite, double longitude, double latitude, uint8_t zoom, unsigned long timeoutMS)
+{
+    uint32_t supersededId;
+    MapReadyCallback supersededCallback;
+
+    std::vector<MapRect> drawn;
+
+    xSemaphoreTake(cacheMutex, portMAX_DELAY);
+    takeAsyncRequest(supersededId, supersededCallback);
+    const bool planned = planMap(mapSprite, longitude, latitude, zoom, timeoutMS, drawn);
+    xSemaphoreGive(cacheMutex);
+
+    if (supersededCallback)
+        supersededCallback(supersededId, false);
+
+    if (!planned)
+        return false;
+
+    notifyDrawn(drawn);
+    drawn.clear();
+
+    // The workers stop at the deadline, the slack covers a decode or connect that is running out
+    TickType_t waitTicks = portMAX_DELAY;
+    if (timeoutMS)
+    {
+        const unsigned long elapsedMS = millis() - startJobsMS;
+        waitTicks = pdMS_TO_TICKS((elapsedMS < timeoutMS ? timeoutMS - elapsedMS : 0) + OSM_DEADLINE_SLACK_MS);
+    }
+    if (!(xEventGroupWaitBits(jobEvents, OSM_JOBS_DONE_BIT, pdFALSE, pdTRUE, waitTicks) & OSM_JOBS_DONE_BIT))
+        log_w("Jobs still running %lu ms past the map timeout, composing the map without them", OSM_DEADLINE_SLACK_MS);
+
+    xSemaphoreTake(cacheMutex, portMAX_DELAY);
+    const bool composed = finishMap(mapSprite, drawn);
+    xSemaphoreGive(cacheMutex);
+
+    notifyDrawn(drawn);
+
+    if (!composed)
+    {
+        log_e("Failed to compose map");
+        return false;
+    }
+    return true;
+}
+
+uint32_t OpenStreetMap::fetchMapAsync(LGFX_Sprite &mapSprite, double longitude, double latitude, uint8_t zoom, MapReadyCallback onReady, unsigned long timeoutMS)
+{
+    if (overscanMargin)
+    {
+        log_e("Overscan only works with fetchMap");
+        return 0;
+    }
+
+    if (!prepareMap(longitude, latitude, zoom))
+        return 0;
+
+    uint32_t supersededId;
+    MapReadyCallback supersededCallback;
+    uint32_t requestId = 0;
+    bool composed = false;
+    bool readyNow = false;
+    std::vector<MapRect> drawn;
+
+    xSemaphoreTake(cacheMutex, portMAX_DELAY);
+    takeAsyncRequest(supersededId, supersededCallback);
+    if (planMap(mapSprite, longitude, latitude, zoom, timeoutMS, drawn))
+    {
+        if (++lastRequestId == 0)
+            ++lastRequestId; // 0 is reserved for failure
+        requestId = lastRequestId;
+        if (pendingJobs.load() == 0)
+        {
+            // Everything was cached, compose right away
+            composed = finishMap(mapSprite, drawn);
+            readyNow = true;
+        }
+        else
+        {
+            asyncRequestId = requestId;
+            asyncSprite = &mapSprite;
+            asyncCallback = std::move(onReady);
+        }
+    }
+    xSemaphoreGive(cacheMutex);
+
+    if (supersededCallback)
+        supersededCallback(supersededId, false);
+
+    notifyDrawn(drawn);
+
+    if (readyNow && onReady)
+        onReady(requestId, composed);
+
+    return requestId;
+}
+
+bool OpenStreetMap::cancelMap(uint32_t requestId)
+{
+    if (!cacheMutex || !requestId)
+        return false;
+
+    uint32_t cancelledId = 0;
+    MapReadyCallback onReady;
+
+    xSemaphoreTake(cacheMutex, portMAX_DELAY);
+    if (asyncRequestId == requestId)
+    {
+        takeAsyncRequest(cancelledId, onReady);
+
+        // The sprite belongs to the caller again, nothing draws into it any more
+        leaseMapSprite(0);
+        progressiveSprite = nullptr;
+    }
+    xSemaphoreGive(cacheMutex);
+
+    if (!cancelledId)
+        return false;
+
+    // Queued tiles are still downloaded into the cache, only the composition is skipped
+    if (onReady)
+        onReady(cancelledId, false);
+    return true;
+}
+
+void OpenStreetMap::PNGDraw(PNGDRAW *pDraw)
+{
+    DecodeContext &context = *currentContext;
+    PNG *png = context.png;
+
+    // Past the map deadline the decoder only runs out, no row is converted or drawn any more
+    if (context.cutOff)
+        return;
+    if (context.budgetMS && millis() - context.startMS >= context.budgetMS)
+    {
+        context.cutOff = true;
+        return;
+    }
+
+    uint16_t *row = nullptr; // full width rgb565 row once converted
+    const MapRect &crop = context.crop;
+    if (context.tileBuffer && pDraw->y >= crop.y && pDraw->y < crop.y + crop.h)
+    {
+        uint16_t *dest = context.tileBuffer + ((pDraw->y - crop.y) * crop.w);
+        if (crop.w == context.tileSize)
+        {
+            row = dest;
+            png->getLineAsRGB565(pDraw, row, PNG_RGB565_BIG_ENDIAN, 0xffffffff);
+        }
+        else
+        {
+            row = context.lineBuffer;
+            png->getLineAsRGB565(pDraw, row, PNG_RGB565_BIG_ENDIAN, 0xffffffff);
+            memcpy(dest, row + crop.x, crop.w * sizeof(uint16_t));
+        }
+    }
+
+    if (!context.mapBuffer)
+        return;
+
+    // The row is written under the sprite lease, so the map can not be reallocated or handed back halfway
+    OpenStreetMap *osm = currentInstance;
+    xSemaphoreTake(osm->spriteMutex, portMAX_DELAY);
+    if (context.generation != osm->leasedGeneration)
+    {
+        xSemaphoreGive(osm->spriteMutex);
+        return;
+    }
+
+    // The sprite stores rgb565 big endian, so rows are copied without conversion
+    for (const auto &[drawX, drawY] : context.targets)
+    {
+        const int mapY = drawY + pDraw->y;
+        if (mapY < 0 || mapY >= context.mapHeight)
+            continue;
+
+        const int first = std::max(0, -drawX);
+        const int last = std::min(context.tileSize, context.mapWidth - drawX);
+        if (first >= last)
+            continue;
+
+        uint16_t *dest = context.mapBuffer + mapY * context.mapWidth + drawX;
+        if (!row)
+        {
+            if (first == 0 && last == context.tileSize)
+            {
+                png->getLineAsRGB565(pDraw, dest, PNG_RGB565_BIG_ENDIAN, 0xffffffff);
+                row = dest;
+                continue;
+            }
+            row = context.lineBuffer;
+            png->getLineAsRGB565(pDraw, row, PNG_RGB565_BIG_ENDIAN, 0xffffffff);
+        }
+        memcpy(dest + first, row + first, (last - first) * sizeof(uint16_t));
+    }
+    xSemaphoreGive(osm->spriteMutex);
+}
+
+void OpenStreetMap::makeTileUrl(char *url, size_t size, uint32_t x, uint32_t y, uint8_t zoom)
+{
+    if (currentProvider->requiresApiKey)
+    {
+        snprintf(url, size,
+                 currentProvider->urlTemplate,
+                 zoom, x, y, currentProvider->apiKey);
+    }
+    else
+    {
+        snprintf(url, size,
+                 currentProvider->urlTemplate,
+                 zoom, x, y);
+    }
+}
+
+MemoryBuffer OpenStreetMap::readLocalTile(uint32_t x, uint32_t y, uint8_t zoom, TileSource &source, TileValidators &validators)
+{
+    source = TileSource::Psram;
+    MemoryBuffer buffer = compressedCache.read(x, y, zoom);
+    if (buffer.isAllocated())
+        return buffer;
+
+    source = TileSource::Disk;
+    buffer = diskCache.read(x, y, zoom, &validators);
+    if (buffer.isAllocated())
+        return buffer;
+
+    source = TileSource::Network;
+    return MemoryBuffer::empty();
+}
+
+bool OpenStreetMap::decodeTile(DecodeContext &context, DecodeItem &item, String &result)
+{
+    [[maybe_unused]] const unsigned long startMS = millis();
+
+    MemoryBuffer &buffer = item.buffer;
+    const uint32_t x = item.job.x;
+    const uint32_t y = item.job.y;
+    const uint8_t zoom = item.job.z;
+    const int16_t rc = context.png->openRAM(buffer.get(), buffer.size(), PNGDraw);
+    if (!runDecoder(context, rc, x, y, zoom, result))
+        return false;
+
+    log_d("decoding tile z=%u x=%lu y=%lu took %lu ms on core %i", zoom, x, y, millis() - startMS, xPortGetCoreID());
+
+    storeTile(x, y, zoom, buffer, item.source, item.validators);
+    return true;
+}
+
+bool OpenStreetMap::runDecoder(DecodeContext &context, int16_t openResult, uint32_t x, uint32_t y, uint8_t zoom, String &result)
+{
+    PNG *png = context.png;
+    if (openResult != PNG_SUCCESS)
+    {
+        result = "PNG Decoder Error: " + String(openResult);
+        return false;
+    }
+
+    if (png->getWidth() != currentProvider->tileSize || png->getHeight() != currentProvider->tileSize)
+    {
+        result = "Unexpected tile size: w=" + String(png->getWidth()) + " h=" + String(png->getHeight());
+        return false;
+    }
+
+    currentInstance = this;
+    currentContext = &context;
+    const int decodeResult = png->decode(0, PNG_FAST_PALETTE);
+    if (context.cutOff)
+    {
+        result = "Decoding tile z=" + String(zoom) + " x=" + String(x) + " y=" + String(y) + " cut off at the map timeout";
+        return false;
+    }
+    if (decodeResult != PNG_SUCCESS)
+    {
+        result = "Decoding tile z=" + String(zoom) + " x=" + String(x) + " y=" + String(y) + " failed with code: " + String(decodeResult);
+        return false;
+    }
+    return true;
+}
+
+void OpenStreetMap::storeTile(uint32_t x, uint32_t y, uint8_t zoom, MemoryBuffer &buffer, TileSource source, const TileValidators &validators)
+{
+    if (source == TileSource::Network || source == TileSource::Disk)
+        compressedCache.store(x, y, zoom, buffer.get(), buffer.size());
+    if (source == TileSource::Network)
+        diskCache.store(x, y, zoom, std::move(buffer), validators);
+}
+
+void *OpenStreetMap::streamOpen(const char *name, int32_t *size)
+{
+    *size = currentStream->size;
+    return currentStream;
+}
+
+void OpenStreetMap::streamClose(void *handle)
+{
+}
+
+bool OpenStreetMap::fillStream(TileStream &stream, int32_t end)
+{
+    while (stream.received < end)
+    {
+        int32_t length = end - stream.received;
+        uint8_t *dest = stream.body + stream.received;
+        if (!stream.body)
+        {
+            const int32_t offset = stream.received % OSM_STREAM_WINDOW;
+            length = std::min(length, OSM_STREAM_WINDOW - offset);
+            dest = stream.window + offset;
+        }
+
+        if (!stream.fetcher->readStream(dest, length))
+        {
+            stream.failed = true;
+            return false;
+        }
+        stream.received += length;
+    }
+    return true;
+}
+
+int32_t OpenStreetMap::streamRead(PNGFILE *file, uint8_t *dest, int32_t length)
+{
+    TileStream &stream = *static_cast<TileStream *>(file->fHandle);
+    if (currentContext && currentContext->cutOff)
+        return 0; // ends a decode that missed the map deadline
+
+    length = std::min(length, file->iSize - file->iPos);
+    if (!stream.body)
+        length = std::min(length, OSM_STREAM_WINDOW);
+    if (length <= 0 || !fillStream(stream, file->iPos + length))
+        return 0;
+
+    if (stream.body)
+        memcpy(dest, stream.body + file->iPos, length);
+    else
+    {
+        if (stream.received - file->iPos > OSM_STREAM_WINDOW)
+        {
+            log_e("PNG decoder went back %ld bytes, past the stream window", stream.received - file->iPos);
+            return 0;
+        }
+
+        // The window is a ring, a read can wrap around its end
+        for (int32_t done = 0; done < length;)
+        {
+            const int32_t offset = (file->iPos + done) % OSM_STREAM_WINDOW;
+            const int32_t part = std::min(length - done, OSM_STREAM_WINDOW - offset);
+            memcpy(dest + done, stream.window + offset, part);
+            done += part;
+        }
+    }
+    file->iPos += length;
+    return length;
+}
+
+int32_t OpenStreetMap::streamSeek(PNGFILE *file, int32_t position)
+{
+    // Only moves the read position, streamRead skips forward or replays from the window
+    file->iPos = std::max<int32_t>(0, std::min(position, file->iSize));
+    return file->iPos;
+}
+
+void OpenStreetMap::streamTile(ReusableTileFetcher &fetcher, const TileJob &job, size_t contentLength, const TileValidators &validators, DecodeContext &context)
+{
+    prepareDecode(job, context);
+    if (!context.lineBuffer)
+        context.mapBuffer = nullptr;
+
+    // The cache tiers need the whole tile, without them only a window of the body is kept
+    const bool keepBody = compressedCache.isEnabled() || diskCache.isEnabled();
+    MemoryBuffer body(keepBody ? contentLength : 0);
+    MemoryBuffer window(keepBody ? 0 : OSM_STREAM_WINDOW);
+    TileStream stream = {&fetcher, body.get(), window.get(), static_cast<int32_t>(contentLength), 0, false};
+
+    const unsigned long startMS = millis();
+    String result;
+    bool success = false;
+    if (!stream.body && !stream.window)
+        result = "Stream buffer allocation failed";
+    else
+    {
+        currentStream = &stream;
+        const int16_t rc = context.png->open("", streamOpen, streamClose, streamRead, streamSeek, PNGDraw);
+        success = runDecoder(context, rc, job.x, job.y, job.z, result);
+        context.png->close();
+        currentStream = nullptr;
+
+        // Only a broken tile is backed off, not a connection or the deadline
+        if (!success && !stream.failed && !context.cutOff)
+            tileFailed(job);
+    }
+
+    log_d("streaming tile z=%u x=%lu y=%lu took %lu ms on core %i", job.z, job.x, job.y, millis() - startMS, xPortGetCoreID());
+
+    // A tile is only cached complete, so the rest of the body is read first
+    if (success && stream.body && fillStream(stream, stream.size))
+        storeTile(job.x, job.y, job.z, body, TileSource::Network, validators);
+
+    if (!success)
+        log_e("Tile stream decode failed: %s", result.c_str());
+    if (!success && pastDeadline(job))
+        ++statCutOff;
+    ++statDownloads;
+    ++statDecodes;
+    ++statStreamed;
+    statDecodeMS += millis() - startMS;
+    finishJob(job, success, &context);
+}
+
+bool OpenStreetMap::takeQueuedJob(QueueHandle_t queue, TileJob &job)
+{
+    if (xSemaphoreTake(jobSignal, 0) != pdTRUE)
+        return false;
+
+    if (xQueueReceive(queue, &job, 0) == pdPASS)
+        return true;
+
+    xSemaphoreGive(jobSignal); // that signal belongs to a job in the other queue
+    return false;
+}
+
+bool OpenStreetMap::jobSuperseded(const TileJob &job)
+{
+    if (job.prefetch || job.generation == mapGeneration.load())
         return false;
+
+    // A tile the newer map uses as well is finished into the cache
+    xSemaphoreTake(cacheMutex, portMAX_DELAY);
+    const bool needed = job.tile && job.tile->neededFrame == currentFrame;
+    xSemaphoreGive(cacheMutex);
+    return !needed;
+}
+
+bool OpenStreetMap::pastDeadline(const TileJob &job) const
+{
+    return !job.prefetch && mapTimeoutMS && millis() - startJobsMS >= mapTimeoutMS;
+}
+
+void OpenStreetMap::runJobBatch(ReusableTileFetcher &fetcher, const TileJob *jobs, size_t count, DecodeContext &streamContext)
+{
+    std::vector<NetworkTile> networkTiles;
+    networkTiles.reserve(count);
+    const uint32_t now = ReusableTileFetcher::unixTime(); // 0 while the time is unknown, disk tiles are then fresh
+
+    for (size_t index = 0; index < count; ++index)
+    {
+        const TileJob &job = jobs[index];
+        if (pastDeadline(job))
+        {
+            log_w("Map timeout (%lu ms) exceeded after %lu ms, dropping job",
+                  mapTimeoutMS, millis() - startJobsMS);
+            ++statCutOff;
+            finishJob(job, false);
+            continue;
+        }
+
+        if (jobSuperseded(job))
+        {
+            log_d("dropping superseded job z=%u x=%lu y=%lu", job.z, job.x, job.y);
+            ++statSuperseded;
+            finishJob(job, false);
+            continue;
+        }
+
+        TileSource source;
+        TileValidators validators = {};
+        MemoryBuffer buffer = readLocalTile(job.x, job.y, job.z, source, validators);
+        const bool expired = source == TileSource::Disk && now && validators.expires <= now;
+        if (buffer.isAllocated() && !expired)
+        {
+            handOffTile(job, std::move(buffer), source);
+            continue;
+        }
+
+        // Jobs queued before the server asked to wait are not sent either, an expired tile is shown as it is
+        if (providerPaused())
+        {
+            if (!job.prefetch)
+                ++statBackedOff;
+            if (buffer.isAllocated())
+                handOffTile(job, std::move(buffer), TileSource::Stale);
+            else
+                finishJob(job, false);
+            continue;
+        }
+
+        // With stale-while-revalidate the map gets the expired tile right away
+        const bool background = expired && staleWhileRevalidate;
+        if (background)
+            handOffTile(job, std::move(buffer), TileSource::Stale);
+        networkTiles.push_back({job, validators, std::move(buffer), expired, background});
+        if (!job.prefetch && !expired)
+            networkTiles.back().hedgeSlot = addHedgeSlot(job);
     }
 
-    mapTimeoutMS = timeoutMS;
-    TileBufferList tilePointers;
-    updateCache(requiredTiles, zoom, tilePointers);
-    if (!composeMap(mapSprite, tilePointers))
+    if (!networkTiles.empty())
+        fetchNetworkTiles(fetcher, networkTiles, streamContext);
+}
+
+void OpenStreetMap::fetchNetworkTiles(ReusableTileFetcher &fetcher, std::vector<NetworkTile> &networkTiles, DecodeContext &streamContext)
+{
+    // Refreshes never hold up the map tiles in the pipeline
+    std::stable_partition(networkTiles.begin(), networkTiles.end(), [](const NetworkTile &tile)
+                          { return !tile.background; });
+
+    const size_t networkCount = networkTiles.size();
+    std::vector<String> urls(networkCount);
+    const char *urlPointers[OSM_PIPELINE_DEPTH];
+    const TileValidators *conditions[OSM_PIPELINE_DEPTH];
+    bool mapJobs = false; // the map deadline holds for the whole pipeline when it carries a map tile
+    bool hedged = false;
+    for (size_t index = 0; index < networkCount; ++index)
     {
-        log_e("Failed to compose map");
-        return false;
+        const TileJob &job = networkTiles[index].job;
+        mapJobs |= !job.prefetch;
+        hedged |= networkTiles[index].hedgeSlot >= 0;
+        char url[256];
+        makeTileUrl(url, sizeof(url), job.x, job.y, job.z);
+        urls[index] = url;
+        urlPointers[index] = urls[index].c_str();
+        conditions[index] = networkTiles[index].revalidate ? &networkTiles[index].stored : nullptr;
     }
-    return true;
+
+    // The next response is waited for from the moment the one before it was read, not from when the batch was sent
+    unsigned long startMS = millis();
+    const auto responseDone = [&](size_t index)
+    {
+        startMS = millis();
+        if (index + 1 < networkCount)
+            restartHedgeClock(networkTiles[index + 1], startMS);
+    };
+
+    // Streamed tiles are decoded by this worker while the body arrives
+    StreamCallback onStream = nullptr;
+    if (streamingDecode && streamContext.png)
+        onStream = [&](size_t index, size_t contentLength, const TileResponse &response)
+        {
+            statDownloadMS += millis() - startMS;
+            NetworkTile &tile = networkTiles[index];
+            finishAttempt(tile); // only the request that answered first streams
+            if (!tile.background)
+                streamTile(fetcher, tile.job, contentLength, response.validators, streamContext);
+            else
+            {
+                // A refresh is not decoded, it only goes to the stores
+                MemoryBuffer buffer(contentLength);
+                const bool received = buffer.isAllocated() && fetcher.readStream(buffer.get(), contentLength);
+                revalidatedTile(tile, received ? std::move(buffer) : MemoryBuffer::empty(), "Refresh download failed", response);
+            }
+            responseDone(index);
+        };
+
+    // Transfers for tiles a newer map does not show are cut off
+    const AbortCallback shouldAbort = [&](size_t index)
+    {
+        const NetworkTile &tile = networkTiles[index];
+        if (lostRace(tile))
+            return true;
+        if (tile.background || !jobSuperseded(tile.job))
+            return false;
+        if (tile.attempt == 1)
+            ++statSuperseded;
+        return true;
+    };
+
+    // With hedging the first of two requests for a tile to answer is read, the other one is dropped
+    FirstByteCallback onFirstByte = nullptr;
+    if (hedging || hedged)
+        onFirstByte = [&](size_t index)
+        { return claimResponse(networkTiles[index], millis() - startMS); };
+
+    // Each response goes to the decoders while the next ones are still on their way
+    fetcher.setDeadline(startJobsMS, mapJobs ? mapTimeoutMS : 0);
+    fetcher.fetchPipelined(urlPointers, conditions, networkCount, 0,
+                           [&](size_t index, MemoryBuffer &&buffer, const String &result, const TileResponse &response)
+                           {
+                               statDownloadMS += millis() - startMS;
+                               NetworkTile &tile = networkTiles[index];
+                               if (!finishAttempt(tile))
+                               {
+                                   log_d("tile z=%u x=%lu y=%lu left to the other request: %s", tile.job.z, tile.job.x, tile.job.y, result.c_str());
+                                   responseDone(index);
+                                   return;
+                               }
+
+                               if (tile.revalidate)
+                                   revalidatedTile(tile, std::move(buffer), result, response);
+                               else if (!buffer.isAllocated())
+                               {
+                                   log_e("Tile fetch failed: %s", result.c_str());
+                                   const int status = response.statusCode;
+                                   if (status && status != 200 && status != 304)
+                                   {
+                                       // Only rate limiting and overload come with a Retry-After worth waiting for
+                                       const uint32_t retryAfter = (status == 429 || status == 503) ? response.retryAfter : 0;
+                                       tileFailed(tile.job, std::min<uint32_t>(retryAfter, OSM_MAX_RETRY_AFTER_MS / 1000) * 1000UL);
+                                   }
+                                   if (pastDeadline(tile.job))
+                                       ++statCutOff;
+                                   finishJob(tile.job, false);
+                               }
+                               else
+                                   handOffTile(tile.job, std::move(buffer), TileSource::Network, response.validators);
+                               responseDone(index);
+                           },
+                           onStream, shouldAbort, onFirstByte);
 }
 
-void OpenStreetMap::PNGDraw(PNGDRAW *pDraw)
+void OpenStreetMap::setHedging(bool enabled, uint8_t percentile)
+{
+    if (!percentile || percentile > 100)
+    {
+        log_e("Hedging percentile must be 1 to 100");
+        return;
+    }
+
+    if (cacheMutex)
+        xSemaphoreTake(cacheMutex, portMAX_DELAY);
+    hedging = enabled;
+    hedgePercentile = percentile;
+    if (cacheMutex)
+        xSemaphoreGive(cacheMutex);
+}
+
+int OpenStreetMap::addHedgeSlot(const TileJob &job)
 {
-    uint16_t *destRow = currentInstance->currentTileBuffer + (pDraw->y * currentInstance->currentProvider->tileSize);
-    getPNGCurrentCore()->getLineAsRGB565(pDraw, destRow, PNG_RGB565_BIG_ENDIAN, 0xffffffff);
+    if (!hedging)
+        return -1;
+
+    int slot = -1;
+    xSemaphoreTake(cacheMutex, portMAX_DELAY);
+    for (int index = 0; index < OSM_HEDGE_SLOTS; ++index)
+    {
+        if (hedgeSlots[index].active)
+            continue;
+        hedgeSlots[index] = {job, millis(), 1, 1, 0};
+        slot = index;
+        break;
+    }
+    xSemaphoreGive(cacheMutex);
+    return slot;
 }
 
-bool OpenStreetMap::fetchTile(ReusableTileFetcher &fetcher, CachedTile &tile, uint32_t x, uint32_t y, uint8_t zoom, String &result, unsigned long timeout)
+unsigned long OpenStreetMap::hedgeDelayMS()
 {
-    char url[256];
-    if (currentProvider->requiresApiKey)
+    // Called with cacheMutex held
+    if (firstByteCount < OSM_HEDGE_MIN_SAMPLES)
+        return ULONG_MAX;
+
+    const size_t count = std::min<uint32_t>(firstByteCount, OSM_HEDGE_SAMPLES);
+    uint16_t samples[OSM_HEDGE_SAMPLES];
+    std::copy(firstByteMS, firstByteMS + count, samples);
+    const size_t rank = std::min(count - 1, (count * hedgePercentile) / 100);
+    std::nth_element(samples, samples + rank, samples + count);
+    return std::max<unsigned long>(samples[rank], OSM_HEDGE_MIN_DELAY_MS);
+}
+
+void OpenStreetMap::runHedge(ReusableTileFetcher &fetcher, DecodeContext &streamContext)
+{
+    std::vector<NetworkTile> networkTiles;
+
+    // The oldest map tile that is still waiting for its first byte gets a second request
+    xSemaphoreTake(cacheMutex, portMAX_DELAY);
+    const unsigned long delayMS = hedgeDelayMS();
+    const unsigned long nowMS = millis();
+    unsigned long longestMS = 0;
+    int slot = -1;
+    for (int index = 0; delayMS != ULONG_MAX && index < OSM_HEDGE_SLOTS; ++index)
     {
-        snprintf(url, sizeof(url),
-                 currentProvider->urlTemplate,
-                 zoom, x, y, currentProvider->apiKey);
+        const HedgeSlot &candidate = hedgeSlots[index];
+        const unsigned long waitedMS = nowMS - candidate.startMS;
+        if (candidate.active != 1 || candidate.attempts != 1 || candidate.winner || waitedMS < delayMS || waitedMS < longestMS ||
+            pastDeadline(candidate.job))
+            continue;
+        slot = index;
+        longestMS = waitedMS;
     }
-    else
+    if (slot >= 0)
     {
-        snprintf(url, sizeof(url),
-                 currentProvider->urlTemplate,
-                 zoom, x, y);
+        HedgeSlot &hedged = hedgeSlots[slot];
+        hedged.attempts = 2;
+        hedged.active = 2;
+        networkTiles.push_back({hedged.job, {}, MemoryBuffer::empty(), false, false, slot, 2});
     }
+    xSemaphoreGive(cacheMutex);
 
-    MemoryBuffer buffer = fetcher.fetchToBuffer(url, result, timeout);
-    if (!buffer.isAllocated())
-        return false;
+    if (networkTiles.empty())
+        return;
 
-    [[maybe_unused]] const unsigned long startMS = millis();
+    ++statHedged;
+    log_d("hedging tile z=%u x=%lu y=%lu after %lu ms", networkTiles[0].job.z, networkTiles[0].job.x, networkTiles[0].job.y, delayMS);
+    fetchNetworkTiles(fetcher, networkTiles, streamContext);
+}
+
+bool OpenStreetMap::claimResponse(const NetworkTile &tile, unsigned long latencyMS)
+{
+    if (tile.job.prefetch || tile.background)
+        return true;
 
-    PNG *png = getPNGCurrentCore();
-    const int16_t rc = png->openRAM(buffer.get(), buffer.size(), PNGDraw);
-    if (rc != PNG_SUCCESS)
+    bool won = true;
+    xSemaphoreTake(cacheMutex, portMAX_DELAY);
+    firstByteMS[firstByteCount++ % OSM_HEDGE_SAMPLES] = std::min<unsigned long>(latencyMS, UINT16_MAX);
+    if (tile.hedgeSlot >= 0)
     {
-        result = "PNG Decoder Error: " + String(rc);
+        HedgeSlot &slot = hedgeSlots[tile.hedgeSlot];
+        won = !slot.winner;
+        if (won)
+            slot.winner = tile.attempt;
+        if (won && tile.attempt == 2)
+            ++statHedgeWins;
+    }
+    xSemaphoreGive(cacheMutex);
+    return won;
+}
+
+void OpenStreetMap::restartHedgeClock(const NetworkTile &tile, unsigned long startMS)
+{
+    if (tile.hedgeSlot < 0 || tile.attempt != 1)
+        return;
+
+    xSemaphoreTake(cacheMutex, portMAX_DELAY);
+    hedgeSlots[tile.hedgeSlot].startMS = startMS;
+    xSemaphoreGive(cacheMutex);
+}
+
+bool OpenStreetMap::lostRace(const NetworkTile &tile)
+{
+    if (tile.hedgeSlot < 0)
         return false;
+
+    xSemaphoreTake(cacheMutex, portMAX_DELAY);
+    const HedgeSlot &slot = hedgeSlots[tile.hedgeSlot];
+    const bool lost = slot.winner && slot.winner != tile.attempt;
+    xSemaphoreGive(cacheMutex);
+    return lost;
+}
+
+bool OpenStreetMap::finishAttempt(const NetworkTile &tile)
+{
+    if (tile.hedgeSlot < 0)
+        return true;
+
+    // The request that answered first finishes the job, without an answer the last one to give up does
+    xSemaphoreTake(cacheMutex, portMAX_DELAY);
+    HedgeSlot &slot = hedgeSlots[tile.hedgeSlot];
+    --slot.active;
+    const bool finishes = slot.winner ? slot.winner == tile.attempt : !slot.active;
+    xSemaphoreGive(cacheMutex);
+    return finishes;
+}
+
+void OpenStreetMap::revalidatedTile(NetworkTile &tile, MemoryBuffer &&buffer, const String &result, const TileResponse &response)
+{
+    const TileJob &job = tile.job;
+    if (response.statusCode == 304)
+    {
+        // The server may leave out validators that did not change
+        TileValidators validators = response.validators;
+        if (!validators.etag[0])
+            memcpy(validators.etag, tile.stored.etag, sizeof(validators.etag));
+        if (!validators.lastModified[0])
+            memcpy(validators.lastModified, tile.stored.lastModified, sizeof(validators.lastModified));
+        diskCache.refresh(job.x, job.y, job.z, validators);
+
+        log_d("tile z=%u x=%lu y=%lu not modified", job.z, job.x, job.y);
+        if (!tile.background)
+            handOffTile(job, std::move(tile.stale), TileSource::Disk);
+        return;
     }
 
-    if (png->getWidth() != currentProvider->tileSize || png->getHeight() != currentProvider->tileSize)
+    if (!buffer.isAllocated())
     {
-        result = "Unexpected tile size: w=" + String(png->getWidth()) + " h=" + String(png->getHeight());
-        return false;
+        if (tile.background)
+            log_w("Tile refresh failed: %s", result.c_str());
+        else
+        {
+            log_w("Tile revalidation failed, using the expired tile: %s", result.c_str());
+            handOffTile(job, std::move(tile.stale), TileSource::Stale);
+        }
+        return;
     }
 
-    currentInstance = this;
-    currentTileBuffer = tile.buffer;
-    const int decodeResult = png->decode(0, PNG_FAST_PALETTE);
-    if (decodeResult != PNG_SUCCESS)
+    if (!tile.background)
     {
-        result = "Decoding " + String(url) + " failed with code: " + String(decodeResult);
-        return false;
+        handOffTile(job, std::move(buffer), TileSource::Network, response.validators);
+        return;
     }
 
-    log_d("decoding %s took %lu ms on core %i", url, millis() - startMS, xPortGetCoreID());
+    // The map shows the old tile, the new one replaces it in the stores and on the next map
+    storeTile(job.x, job.y, job.z, buffer, TileSource::Network, response.validators);
+    xSemaphoreTake(cacheMutex, portMAX_DELAY);
+    const int slot = tilesIndex.find(TileCacheIndex::makeKey(job.x, job.y, job.z));
+    CachedTile *cached = slot >= 0 ? &tilesCache[slot] : nullptr;
+    if (cached && cached->busy)
+        cached->outdated = true; // the expired copy is still being decoded for the map that waits for it
+    else if (cached && cached->valid)
+        retireTile(*cached);
+    xSemaphoreGive(cacheMutex);
+}
 
-    tile.x = x;
-    tile.y = y;
-    tile.z = zoom;
-    return true;
+void OpenStreetMap::tileFailed(const TileJob &job, unsigned long retryAfterMS)
+{
+    xSemaphoreTake(cacheMutex, portMAX_DELAY);
+    tileFailures.fail(currentProvider, job.x, job.y, job.z, retryAfterMS);
+    xSemaphoreGive(cacheMutex);
 }
 
-void OpenStreetMap::tileFetcherTask(void *param)
+bool OpenStreetMap::providerPaused()
+{
+    xSemaphoreTake(cacheMutex, portMAX_DELAY);
+    const bool paused = tileFailures.paused(currentProvider);
+    xSemaphoreGive(cacheMutex);
+    return paused;
+}
+
+void OpenStreetMap::handOffTile(const TileJob &job, MemoryBuffer &&buffer, TileSource source, const TileValidators &validators)
+{
+    ++statDownloads;
+    DecodeItem *item = new (std::nothrow) DecodeItem{job, std::move(buffer), source, validators};
+    if (!item)
+    {
+        log_e("Could not queue tile for decoding");
+        finishJob(job, false);
+        return;
+    }
+
+    // Blocks while the decoders are behind, so downloads can not run away with the memory
+    const unsigned long startMS = millis();
+    xQueueSend(decodeQueue, &item, portMAX_DELAY);
+    statStallMS += millis() - startMS;
+}
+
+void OpenStreetMap::decodeJob(DecodeItem &item, DecodeContext &context)
+{
+    const TileJob &job = item.job;
+    if (jobSuperseded(job))
+    {
+        // Not decoded, but the download is kept in the stores
+        ++statSuperseded;
+        storeTile(job.x, job.y, job.z, item.buffer, item.source, item.validators);
+        finishJob(job, false);
+        return;
+    }
+
+    if (pastDeadline(job))
+    {
+        // Too late for this map, the next one decodes it from the stores
+        ++statCutOff;
+        storeTile(job.x, job.y, job.z, item.buffer, item.source, item.validators);
+        finishJob(job, false);
+        return;
+    }
+
+    prepareDecode(job, context);
+    if (!context.lineBuffer)
+        context.mapBuffer = nullptr; // no scratch row, fall back to drawing from the cache
+
+    const unsigned long startMS = millis();
+    String result;
+    const bool success = decodeTile(context, item, result);
+    if (!success)
+        log_e("Tile decode failed: %s", result.c_str());
+    if (!success && context.cutOff)
+        ++statCutOff;
+    else if (!success)
+        tileFailed(job);
+    ++statDecodes;
+    statDecodeMS += millis() - startMS;
+    finishJob(job, success, &context);
+}
+
+void OpenStreetMap::tileDecoderTask(void *param)
 {
-    ReusableTileFetcher fetcher;
     OpenStreetMap *osm = static_cast<OpenStreetMap *>(param);
+    std::unique_ptr<uint16_t[]> lineBuffer(new (std::nothrow) uint16_t[OSM_MAX_TILESIZE]);
+    DecodeContext context = {};
+    context.lineBuffer = lineBuffer.get();
+    context.png = getPNGForCore(osm->nextDecoder++);
     while (true)
     {
-        TileJob job;
-        xQueueReceive(osm->jobQueue, &job, portMAX_DELAY);
-        [[maybe_unused]] const unsigned long startMS = millis();
-
-        if (job.z == 255)
+        DecodeItem *item;
+        xQueueReceive(osm->decodeQueue, &item, portMAX_DELAY);
+        if (!item)
             break;
 
-        const uint32_t elapsedMS = millis() - osm->startJobsMS;
-        if (osm->mapTimeoutMS && elapsedMS >= osm->mapTimeoutMS)
-        {
-            log_w("Map timeout (%lu ms) exceeded after %lu ms, dropping job",
-                  osm->mapTimeoutMS, elapsedMS);
+        osm->decodeJob(*item, context);
+        delete item;
+    }
+    log_d("decoder on core %i exiting", xPortGetCoreID());
+    xTaskNotifyGive(osm->ownerTask);
+    vTaskDelete(nullptr);
+}
+
+PipelineStats OpenStreetMap::getPipelineStats() const
+{
+    return {statDownloads.load(), statDownloadMS.load(), statDecodes.load(), statDecodeMS.load(), statStallMS.load(), statStreamed.load(),
+            statSuperseded.load(), statCutOff.load(), statHedged.load(), statHedgeWins.load(),
+            statBackedOff.load()};
+}
+
+void OpenStreetMap::resetPipelineStats()
+{
+    statDownloads = 0;
+    statDownloadMS = 0;
+    statDecodes = 0;
+    statDecodeMS = 0;
+    statStallMS = 0;
+    statStreamed = 0;
+    statSuperseded = 0;
+    statCutOff = 0;
+    statHedged = 0;
+    statHedgeWins = 0;
+    statBackedOff = 0;
+}
 
-            osm->invalidateTile(job.tile);
-            --osm->pendingJobs;
+void OpenStreetMap::tileFetcherTask(void *param)
+{
+    ReusableTileFetcher fetcher;
+    OpenStreetMap *osm = static_cast<OpenStreetMap *>(param);
+    TileJob batch[OSM_PIPELINE_DEPTH];
+    DecodeContext streamContext = {}; // decodes tiles straight from the socket
+    std::unique_ptr<uint16_t[]> lineBuffer;
+    bool exiting = false;
+    while (!exiting)
+    {
+        // With hedging an idle worker looks for map tiles that are slow to answer on other connections
+        if (xSemaphoreTake(osm->jobSignal, osm->hedging ? pdMS_TO_TICKS(OSM_HEDGE_POLL_MS) : portMAX_DELAY) != pdTRUE)
+        {
+            osm->runHedge(fetcher, streamContext);
             continue;
         }
 
-        uint32_t remainingMS = 0;
-        if (osm->mapTimeoutMS > 0)
+        // Map jobs go first, prefetch jobs only run when no map is waiting
+        QueueHandle_t queue = osm->jobQueue;
+        if (xQueueReceive(queue, &batch[0], 0) != pdPASS)
         {
-            remainingMS = osm->mapTimeoutMS - elapsedMS;
-            if (remainingMS == 0)
-            {
-                log_w("No budget left for job, dropping");
-                osm->invalidateTile(job.tile);
-                --osm->pendingJobs;
-                continue;
-            }
+            queue = osm->prefetchQueue;
+            if (xQueueReceive(queue, &batch[0], 0) != pdPASS)
+                continue; // the job was dropped by a new map
         }
 
-        String result;
-        if (!osm->fetchTile(fetcher, *job.tile, job.x, job.y, job.z, result, remainingMS))
+        if (batch[0].z == 255)
+            break;
+
+        // Take this worker's share of the waiting jobs of the same kind so their requests can be pipelined
+        const size_t waiting = uxQueueMessagesWaiting(queue) + 1;
+        const size_t share = std::min<size_t>(OSM_PIPELINE_DEPTH, (waiting + osm->numberOfWorkers - 1) / osm->numberOfWorkers);
+        size_t count = 1;
+        while (count < share && osm->takeQueuedJob(queue, batch[count]))
         {
-            log_e("Tile fetch failed: %s", result.c_str());
-            osm->invalidateTile(job.tile);
+            if (batch[count].z == 255)
+            {
+                exiting = true;
+                break;
+            }
+            ++count;
         }
-        else
+
+        // A streaming worker needs its own decoder
+        if (osm->streamingDecode && !streamContext.png)
         {
-            job.tile->valid = true;
-            log_d("core %i fetched tile z=%u x=%lu, y=%lu in %lu ms",
-                  xPortGetCoreID(), job.z, job.x, job.y, millis() - startMS);
+            streamContext.png = allocatePNG();
+            lineBuffer.reset(new (std::nothrow) uint16_t[OSM_MAX_TILESIZE]);
+            streamContext.lineBuffer = lineBuffer.get();
+            if (!streamContext.png)
+                log_w("No memory for a streaming decoder, tiles are buffered");
         }
-        job.tile->busy = false;
-        --osm->pendingJobs;
+
+        [[maybe_unused]] const unsigned long startMS = millis();
+        osm->runJobBatch(fetcher, batch, count, streamContext);
+        log_d("core %i ran %u jobs in %lu ms", xPortGetCoreID(), count, millis() - startMS);
     }
+    freePNG(streamContext.png);
     log_d("task on core %i exiting", xPortGetCoreID());
     xTaskNotifyGive(osm->ownerTask);
     vTaskDelete(nullptr);
@@ -473,6 +2572,19 @@ bool OpenStreetMap::startTileWorkerTasks()
     if (tasksStarted)
         return true;
 
+    if (!cacheMutex)
+        cacheMutex = xSemaphoreCreateMutex();
+    if (!spriteMutex)
+        spriteMutex = xSemaphoreCreateMutex();
+    if (!jobEvents)
+        jobEvents = xEventGroupCreate();
+    if (!cacheMutex || !spriteMutex || !jobEvents)
+    {
+        log_e("Failed to create job signalling");
+        return false;
+    }
+    xEventGroupSetBits(jobEvents, OSM_JOBS_DONE_BIT);
+
     if (!jobQueue)
     {
         jobQueue = xQueueCreate(OSM_JOB_QUEUE_SIZE, sizeof(TileJob));
@@ -483,35 +2595,162 @@ bool OpenStreetMap::startTileWorkerTasks()
         }
     }
 
-    numberOfWorkers = OSM_FORCE_SINGLECORE ? 1 : ESP.getChipCores();
-    for (int core = 0; core < numberOfWorkers; ++core)
+    if (!prefetchQueue)
+        prefetchQueue = xQueueCreate(OSM_PREFETCH_QUEUE_SIZE, sizeof(TileJob));
+    if (!jobSignal)
+        jobSignal = xSemaphoreCreateCounting(OSM_JOB_QUEUE_SIZE + OSM_PREFETCH_QUEUE_SIZE, 0);
+    if (!prefetchQueue || !jobSignal)
+    {
+        log_e("Failed to create prefetch queue!");
+        return false;
+    }
+
+    if (!decodeQueue)
+    {
+        decodeQueue = xQueueCreate(OSM_DECODE_QUEUE_SIZE, sizeof(DecodeItem *));
+        if (!decodeQueue)
+        {
+            log_e("Failed to create decode queue!");
+            return false;
+        }
+    }
+
+    // Network concurrency follows the worker count, decoding runs in one task per core
+    const int cores = ESP.getChipCores();
+    const int workers = workerConfig.workers ? workerConfig.workers : cores;
+    const bool pinned = workerConfig.core != OSM_WORKERS_ON_ALL_CORES && workerConfig.core != tskNO_AFFINITY;
+    const int decoders = pinned ? 1 : std::min(cores, 2);
+    for (int decoder = 0; decoder < decoders; ++decoder)
     {
-        if (!getPNGForCore(core))
+        if (!getPNGForCore(decoder))
         {
-            log_e("Failed to initialize PNG decoder on core %d", core);
+            log_e("Failed to initialize PNG decoder %d", decoder);
             return false;
         }
     }
 
     ownerTask = xTaskGetCurrentTaskHandle();
-    for (int core = 0; core < numberOfWorkers; ++core)
+    nextDecoder = 0;
+    numberOfDecoders = 0;
+    for (int decoder = 0; decoder < decoders; ++decoder)
     {
-        if (!xTaskCreatePinnedToCore(tileFetcherTask,
+        const BaseType_t core = (workerConfig.core == OSM_WORKERS_ON_ALL_CORES) ? decoder : workerConfig.core;
+        if (!xTaskCreatePinnedToCore(tileDecoderTask,
                                      nullptr,
-                                     OSM_TASK_STACKSIZE,
+                                     workerConfig.stackSize, // decoders run finishJob, composing and the user callbacks too
                                      this,
-                                     OSM_TASK_PRIORITY,
+                                     workerConfig.priority,
+                                     &decoderTasks[decoder],
+                                     core))
+        {
+            log_e("Failed to create tile decoder task %d", decoder);
+            break;
+        }
+        ++numberOfDecoders;
+    }
+
+    numberOfWorkers = 0;
+    if (numberOfDecoders < decoders)
+    {
+        tasksStarted = numberOfDecoders > 0;
+        stopTileWorkerTasks();
+        return false;
+    }
+
+    for (int worker = 0; worker < workers; ++worker)
+    {
+        const BaseType_t core = (workerConfig.core == OSM_WORKERS_ON_ALL_CORES) ? worker % cores : workerConfig.core;
+        if (!xTaskCreatePinnedToCore(tileFetcherTask,
                                      nullptr,
-                                     OSM_FORCE_SINGLECORE ? OSM_SINGLECORE_NUMBER : core))
+                                     workerConfig.stackSize,
+                                     this,
+                                     workerConfig.priority,
+                                     &fetcherTasks[worker],
+                                     core))
         {
-            log_e("Failed to create tile fetcher task on core %d", core);
-            return false;
+            log_e("Failed to create tile fetcher task %d", worker);
+            break;
         }
+        ++numberOfWorkers;
+    }
+
+    tasksStarted = numberOfWorkers > 0 || numberOfDecoders > 0;
+    if (numberOfWorkers < workers)
+    {
+        stopTileWorkerTasks();
+        return false;
+    }
+
+    log_i("Started %d tile worker and %d decoder task(s)", numberOfWorkers, numberOfDecoders);
+    return true;
+}
+
+void OpenStreetMap::stopTileWorkerTasks()
+{
+    if (!jobQueue || !tasksStarted)
+        return;
+
+    ownerTask = xTaskGetCurrentTaskHandle();
+    constexpr TileJob poison = {0, 0, 255, nullptr, false, 0};
+    for (int i = 0; i < numberOfWorkers; ++i)
+        if (xQueueSend(jobQueue, &poison, portMAX_DELAY) != pdPASS)
+            log_e("Failed to send poison pill to tile worker %d", i);
+        else
+            xSemaphoreGive(jobSignal);
+
+    for (int i = 0; i < numberOfWorkers; ++i)
+        ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
+
+    // The workers are gone, so nothing new reaches the decoders
+    DecodeItem *stop = nullptr;
+    for (int i = 0; i < numberOfDecoders; ++i)
+        xQueueSend(decodeQueue, &stop, portMAX_DELAY);
+
+    for (int i = 0; i < numberOfDecoders; ++i)
+        ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
+
+    ownerTask = nullptr;
+    tasksStarted = false;
+    numberOfWorkers = 0;
+    numberOfDecoders = 0;
+}
+
+bool OpenStreetMap::onMapTask() const
+{
+    const TaskHandle_t current = xTaskGetCurrentTaskHandle();
+    for (int i = 0; i < numberOfWorkers; ++i)
+        if (fetcherTasks[i] == current)
+            return true;
+    for (int i = 0; i < numberOfDecoders; ++i)
+        if (decoderTasks[i] == current)
+            return true;
+    return false;
+}
+
+bool OpenStreetMap::setWorkerConfig(const WorkerConfig &config)
+{
+    if (config.workers > OSM_MAX_WORKERS || !config.stackSize)
+    {
+        log_e("Invalid worker config");
+        return false;
+    }
+
+    if (onMapTask())
+    {
+        log_e("Can not change workers from a map callback");
+        return false;
     }
 
-    tasksStarted = true;
+    if (!lockWhenIdle())
+    {
+        log_e("Can not change workers while a map is being fetched");
+        return false;
+    }
+    unlockCache(); // stopping the workers waits for them, and they may need the mutex on their way out
 
-    log_i("Started %d tile worker task(s)", numberOfWorkers);
+    // The workers are restarted with the new settings by the next map
+    stopTileWorkerTasks();
+    workerConfig = config;
     return true;
 }
 
@@ -531,20 +2770,37 @@ bool OpenStreetMap::setTileProvider(int index)
         return false;
     }
 
+    if (!lockWhenIdle())
+    {
+        log_e("Can not change provider while a map is being fetched");
+        return false;
+    }
+
     currentProvider = &tileProviders[index];
     freeTilesCache();
+    compressedCache.clear();
+    diskCache.setProvider(*currentProvider);
+    unlockCache();
     log_i("provider changed to '%s'", currentProvider->name);
     return true;
 }
 
+bool OpenStreetMap::enableDiskCache(fs::FS &fs, const char *path, uint32_t maxSizeMB)
+{
+    if (!maxSizeMB)
+    {
+        log_e("Invalid disk cache size: %lu", maxSizeMB);
+        return false;
+    }
+    return diskCache.begin(fs, path, static_cast<uint64_t>(maxSizeMB) * 1024 * 1024, *currentProvider);
+}
+
 void OpenStreetMap::invalidateTile(CachedTile *tile)
 {
     if (!tile)
         return;
 
-    const size_t tileByteCount = currentProvider->tileSize * currentProvider->tileSize * 2;
-    memset(tile->buffer, 0, tileByteCount);
-
-    tile->valid = false;
+    // The pixels are left as they are, nothing draws a tile that is not valid
+    retireTile(*tile);
     tile->busy = false;
 }
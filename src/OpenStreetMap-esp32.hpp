@@ -29,14 +29,20 @@
 #include <SD.h>
 #include <vector>
 #include <atomic>
+#include <functional>
 #include <LovyanGFX.hpp>
 #include <PNGdec.h>
 
 #include "TileProvider.hpp"
 #include "CachedTile.hpp"
+#include "TileCacheIndex.hpp"
+#include "TilePool.hpp"
 #include "TileJob.hpp"
 #include "MemoryBuffer.hpp"
 #include "ReusableTileFetcher.hpp"
+#include "TileDiskCache.hpp"
+#include "CompressedTileCache.hpp"
+#include "TileFailureCache.hpp"
 #include "fonts/DejaVu9-modded.h"
 
 constexpr uint16_t OSM_BGCOLOR = lgfx::color565(32, 32, 128);
@@ -45,34 +51,188 @@ constexpr uint32_t OSM_TASK_STACKSIZE = 6144;
 constexpr uint32_t OSM_JOB_QUEUE_SIZE = 50;
 constexpr bool OSM_FORCE_SINGLECORE = false;
 constexpr int OSM_SINGLECORE_NUMBER = 1;
+constexpr BaseType_t OSM_WORKERS_ON_ALL_CORES = -1; // spread the workers over the cores
+constexpr uint8_t OSM_MAX_WORKERS = 16;
+constexpr uint32_t OSM_DECODE_QUEUE_SIZE = 4; // downloaded tiles waiting for a decoder
+constexpr int32_t OSM_STREAM_WINDOW = 4096; // received bytes PNGdec can read again, at least its file buffer
+constexpr unsigned long OSM_DEADLINE_SLACK_MS = 100; // fetchMap waits this long past its timeout for cut off jobs to finish
+constexpr uint8_t OSM_HEDGE_PERCENTILE = 95;          // first byte latency after which a map tile is requested again
+constexpr int OSM_HEDGE_SAMPLES = 32;                 // first byte latencies the percentile is taken from
+constexpr int OSM_HEDGE_MIN_SAMPLES = 8;              // no hedging before this many responses were measured
+constexpr unsigned long OSM_HEDGE_POLL_MS = 10;       // idle workers look for slow tiles this often
+constexpr unsigned long OSM_HEDGE_MIN_DELAY_MS = 20;  // a fast server does not get every tile requested twice
+constexpr int OSM_HEDGE_SLOTS = OSM_MAX_WORKERS * OSM_PIPELINE_DEPTH;
+constexpr EventBits_t OSM_JOBS_DONE_BIT = BIT0;
+constexpr int OSM_CROPPED_SLOTS_PER_TILE = 2; // cache slots per full tile of memory when cropping
+constexpr int OSM_ATTRIBUTION_HEIGHT = 10;
+constexpr int OSM_FALLBACK_PARENT_LEVELS = 2; // zoom levels to look up for a missing tile
+constexpr uint32_t OSM_PREFETCH_QUEUE_SIZE = 16;
+constexpr int OSM_PREFETCH_HISTORY = 4;            // positions kept by addPositionHint
+constexpr int OSM_PREFETCH_STEPS = 4;              // predicted map positions along the path
+constexpr float OSM_PREFETCH_LOOKAHEAD_S = 20.0f;  // how far ahead the path is predicted
+constexpr double OSM_METERS_PER_DEGREE = 111320.0; // along a meridian
 
 static_assert(OSM_SINGLECORE_NUMBER < 2, "OSM_SINGLECORE_NUMBER must be 0 or 1 (ESP32 has only 2 cores)");
 
+enum class CachePolicy
+{
+    LRU,  // evict the least recently used tile
+    CLOCK // second chance sweep over the cache slots
+};
+
+struct CacheStats
+{
+    uint32_t hits;
+    uint32_t misses;
+    uint32_t evictions;
+};
+
+struct WorkerConfig
+{
+    uint8_t workers = 0; // 0 means one per core
+    uint32_t stackSize = OSM_TASK_STACKSIZE;
+    UBaseType_t priority = OSM_TASK_PRIORITY;
+    BaseType_t core = OSM_FORCE_SINGLECORE ? OSM_SINGLECORE_NUMBER : OSM_WORKERS_ON_ALL_CORES; // or a core number or tskNO_AFFINITY
+};
+
+struct PipelineStats
+{
+    uint32_t downloads;  // tiles read from the network or a cache tier
+    uint32_t downloadMS; // time spent downloading
+    uint32_t decodes;
+    uint32_t decodeMS;
+    uint32_t stallMS;  // time downloads waited for a free decode queue slot
+    uint32_t streamed;   // tiles decoded straight from the socket, also counted as downloads and decodes
+    uint32_t superseded; // jobs dropped or cut off because a newer map did not need their tile
+    uint32_t cutOff;     // map jobs dropped, downloads and decodes broken off at the map timeout
+    uint32_t hedged;     // map tiles requested again on an idle connection
+    uint32_t hedgeWins;  // hedged requests that answered first
+    uint32_t backedOff;  // map tiles not requested because they failed recently
+};
+
+struct PrefetchStats
+{
+    uint32_t requested; // prefetch jobs queued
+    uint32_t completed; // prefetched tiles stored in the cache
+    uint32_t failed;
+    uint32_t dropped; // queued jobs dropped by a new map
+    uint32_t hits;    // prefetched tiles a map used
+    uint32_t wasted;  // prefetched tiles evicted unused
+};
+
+struct PositionHint
+{
+    double longitude;
+    double latitude;
+    unsigned long timeMS;
+};
+
 using tileList = std::vector<std::pair<uint32_t, int32_t>>;
-using TileBufferList = std::vector<uint16_t *>;
+using CachedTileList = std::vector<CachedTile *>;
+// Runs on a map task, it may start the next map with fetchMapAsync but not with the blocking fetchMap
+using MapReadyCallback = std::function<void(uint32_t requestId, bool success)>;
+
+struct MapRect
+{
+    int16_t x;
+    int16_t y;
+    uint16_t w;
+    uint16_t h;
+};
+
+using TileDrawnCallback = std::function<void(const MapRect &rect)>;
+// Higher loads earlier, 0 loads last. Runs with the tile cache locked, so it must not call back into OpenStreetMap
+using TileWeightCallback = std::function<float(const MapRect &rect)>;
+
+struct DecodeContext
+{
+    PNG *png;               // decoder owned by this decode task
+    uint16_t *tileBuffer;   // cache slot receiving the tile, nullptr when the tile is not cached
+    MapRect crop;           // part of the tile stored in tileBuffer
+    uint16_t *lineBuffer;   // scratch row for tiles that are only partly visible
+    uint16_t *mapBuffer;    // sprite framebuffer to decode straight into, nullptr when not drawing
+    int tileSize;
+    int mapWidth;
+    int mapHeight;
+    uint32_t generation;
+    std::vector<std::pair<int, int>> targets; // top left map positions of this tile
+    unsigned long startMS;                    // map deadline, no deadline when budgetMS is 0
+    unsigned long budgetMS;
+    bool cutOff;                              // the deadline passed while decoding, the remaining rows are skipped
+};
+
+enum class TileSource
+{
+    Network,
+    Psram, // compressed tile cache
+    Disk,
+    Stale // expired disk tile shown while it is refreshed, not stored again
+};
+
+struct DecodeItem
+{
+    TileJob job;
+    MemoryBuffer buffer;
+    TileSource source;
+    TileValidators validators; // caching headers of a downloaded tile
+};
+
+struct NetworkTile
+{
+    TileJob job;
+    TileValidators stored; // validators of an expired disk tile
+    MemoryBuffer stale;    // that tile, kept for a 304 or a failed revalidation
+    bool revalidate;       // send a conditional request
+    bool background;       // the map already got the stale tile, only the stores are refreshed
+    int hedgeSlot = -1;    // HedgeSlot shared by both requests for this tile, -1 when it is not hedged
+    uint8_t attempt = 1;   // 2 for the hedged request
+};
+
+struct HedgeSlot
+{
+    TileJob job;
+    unsigned long startMS; // the response before it on the connection was read
+    uint8_t attempts;      // 2 once an idle worker hedged the tile
+    uint8_t active;        // requests still running, the slot is free at 0
+    uint8_t winner;        // attempt that answered first, 0 while none did
+};
+
+struct TileStream
+{
+    ReusableTileFetcher *fetcher;
+    uint8_t *body;   // the whole tile when a cache tier stores it, otherwise nullptr
+    uint8_t *window; // the last OSM_STREAM_WINDOW bytes received when the body is not kept
+    int32_t size;
+    int32_t received;
+    bool failed; // a read from the connection failed
+};
 
 namespace
 {
     PNG *pngCore0 = nullptr;
     PNG *pngCore1 = nullptr;
 
+    PNG *allocatePNG()
+    {
+        void *mem = heap_caps_malloc(sizeof(PNG), MALLOC_CAP_SPIRAM);
+        return mem ? new (mem) PNG() : nullptr;
+    }
+
+    void freePNG(PNG *png)
+    {
+        if (!png)
+            return;
+        png->~PNG();
+        heap_caps_free(png);
+    }
+
     PNG *getPNGForCore(int coreID)
     {
         PNG *&ptr = (coreID == 0) ? pngCore0 : pngCore1;
         if (!ptr)
-        {
-            void *mem = heap_caps_malloc(sizeof(PNG), MALLOC_CAP_SPIRAM);
-            if (!mem)
-                return nullptr;
-            ptr = new (mem) PNG();
-        }
+            ptr = allocatePNG();
         return ptr;
     }
-
-    PNG *getPNGCurrentCore()
-    {
-        return getPNGForCore(xPortGetCoreID());
-    }
 }
 
 class OpenStreetMap
@@ -89,9 +249,47 @@ public:
     void setSize(uint16_t w, uint16_t h);
     uint16_t tilesNeeded(uint16_t mapWidth, uint16_t mapHeight);
     bool resizeTilesCache(uint16_t numberOfTiles);
+    bool setTileCropping(bool enabled);
     bool fetchMap(LGFX_Sprite &sprite, double longitude, double latitude, uint8_t zoom, unsigned long timeoutMS = 0);
+    uint32_t fetchMapAsync(LGFX_Sprite &sprite, double longitude, double latitude, uint8_t zoom, MapReadyCallback onReady, unsigned long timeoutMS = 0);
+    bool cancelMap(uint32_t requestId);
+    void setProgressive(bool enabled, TileDrawnCallback onTileDrawn = nullptr);
+    void setDirectDecode(bool enabled, bool cacheTiles = true);
+    void setStreamingDecode(bool enabled) { streamingDecode = enabled; };
+    void setStaleWhileRevalidate(bool enabled) { staleWhileRevalidate = enabled; };
+    void setHedging(bool enabled, uint8_t percentile = OSM_HEDGE_PERCENTILE);
+    void setIncrementalPan(bool enabled);
+    bool setOverscan(uint16_t marginPixels);
     inline void freeTilesCache();
 
+    void setCachePolicy(CachePolicy policy) { cachePolicy = policy; };
+    CachePolicy getCachePolicy() const { return cachePolicy; };
+    CacheStats getCacheStats() const;
+    void resetCacheStats();
+
+    bool resizeCompressedCache(uint32_t sizeKB) { return compressedCache.resize(sizeKB * 1024); };
+    CompressedCacheStats getCompressedCacheStats() { return compressedCache.getStats(); };
+
+    bool enableDiskCache(fs::FS &fs, const char *path = "/osm-tiles", uint32_t maxSizeMB = 64);
+    void disableDiskCache() { diskCache.end(); };
+    DiskCacheStats getDiskCacheStats() { return diskCache.getStats(); };
+
+    void setMotionHint(double longitude, double latitude, float headingDeg, float speedMS);
+    void addPositionHint(double longitude, double latitude);
+    void clearMotionHint();
+    void setFocusPoint(double longitude, double latitude);
+    void clearFocusPoint();
+    void setTileWeights(TileWeightCallback weight);
+    PrefetchStats getPrefetchStats();
+    void resetPrefetchStats();
+
+    bool setWorkerConfig(const WorkerConfig &config);
+    WorkerConfig getWorkerConfig() const { return workerConfig; };
+    PipelineStats getPipelineStats() const;
+    BufferPoolStats getBufferPoolStats() { return BufferPool::global().getStats(); };
+    void resetBufferPoolStats() { BufferPool::global().resetStats(); };
+    void resetPipelineStats();
+
     bool setTileProvider(int index);
     const char *getProviderName() { return currentProvider->name; };
     int getMinZoom() const { return currentProvider->minZoom; };
@@ -101,34 +299,200 @@ private:
     double lon2tile(double lon, uint8_t zoom);
     double lat2tile(double lat, uint8_t zoom);
     void computeRequiredTiles(double longitude, double latitude, uint8_t zoom, tileList &requiredTiles);
-    void updateCache(const tileList &requiredTiles, uint8_t zoom, TileBufferList &tilePointers);
+    bool prepareMap(double &longitude, double &latitude, uint8_t zoom);
+    bool planMap(LGFX_Sprite &mapSprite, double longitude, double latitude, uint8_t zoom, unsigned long timeoutMS, std::vector<MapRect> &drawn);
+    bool runMap(LGFX_Sprite &mapSprite, double longitude, double latitude, uint8_t zoom, unsigned long timeoutMS);
+    bool showWindow(LGFX_Sprite &viewSprite, double longitude, double latitude, uint8_t zoom, bool anyBacking);
+    void refillBacking(double longitude, double latitude, uint8_t zoom);
+    void updateCache(const tileList &requiredTiles, uint8_t zoom, CachedTileList &tilePointers);
+    void prepareDecode(const TileJob &job, DecodeContext &context);
+    void finishJob(const TileJob &job, bool success, const DecodeContext *context = nullptr);
+    void takeAsyncRequest(uint32_t &requestId, MapReadyCallback &onReady);
     bool startTileWorkerTasks();
-    void makeJobList(const tileList &requiredTiles, std::vector<TileJob> &jobs, uint8_t zoom, TileBufferList &tilePointers);
+    void stopTileWorkerTasks();
+    void handOffTile(const TileJob &job, MemoryBuffer &&buffer, TileSource source, const TileValidators &validators = {});
+    static void tileDecoderTask(void *param);
+    void makeJobList(const tileList &requiredTiles, std::vector<TileJob> &jobs, uint8_t zoom, CachedTileList &tilePointers);
     void runJobs(const std::vector<TileJob> &jobs);
-    CachedTile *findUnusedTile(const tileList &requiredTiles, uint8_t zoom);
+    float tilePriority(size_t tileIndex, uint8_t zoom);
+    void sortJobs(std::vector<TileJob> &jobs, const std::vector<float> &priorities);
+    void addPendingJob();
+    void planPrefetch();
+    void predictViewport(double longitude, double latitude, uint8_t zoom, tileList &tiles);
+    void dropPrefetchJobs();
+    bool lockWhenIdle();
+    bool onMapTask() const;
+    void unlockCache();
+    bool allocateTilesCache(uint16_t numberOfTiles);
+    CachedTile *findUnusedTile();
+    CachedTile *findLeastRecentlyUsedTile();
+    CachedTile *findSpareTile();
+    CachedTile *findClockTile();
+    void touchTile(CachedTile &tile);
+    void retireTile(CachedTile &tile);
+    void unlinkTile(int slot);
+    void linkTile(int slot, bool newest);
     CachedTile *isTileCached(uint32_t x, uint32_t y, uint8_t z);
-    bool fetchTile(ReusableTileFetcher &fetcher, CachedTile &tile, uint32_t x, uint32_t y, uint8_t zoom, String &result, unsigned long timeoutMS);
-    bool composeMap(LGFX_Sprite &mapSprite, TileBufferList &tilePointers);
+    bool assignTile(CachedTile &tile, uint32_t x, uint32_t y, uint8_t z, const MapRect &part);
+    bool allocateTileBuffer(CachedTile &tile, const MapRect &part);
+    void releaseTileBuffer(CachedTile &tile);
+    CachedTile *findPoolVictim(const CachedTile &exclude);
+    MapRect visibleTilePart(size_t tileIndex, bool crop);
+    bool takeQueuedJob(QueueHandle_t queue, TileJob &job);
+    bool jobSuperseded(const TileJob &job);
+    bool pastDeadline(const TileJob &job) const;
+    void runJobBatch(ReusableTileFetcher &fetcher, const TileJob *jobs, size_t count, DecodeContext &streamContext);
+    void fetchNetworkTiles(ReusableTileFetcher &fetcher, std::vector<NetworkTile> &networkTiles, DecodeContext &streamContext);
+    int addHedgeSlot(const TileJob &job);
+    unsigned long hedgeDelayMS();
+    void runHedge(ReusableTileFetcher &fetcher, DecodeContext &streamContext);
+    bool claimResponse(const NetworkTile &tile, unsigned long latencyMS);
+    void restartHedgeClock(const NetworkTile &tile, unsigned long startMS);
+    bool lostRace(const NetworkTile &tile);
+    bool finishAttempt(const NetworkTile &tile);
+    void tileFailed(const TileJob &job, unsigned long retryAfterMS = 0);
+    bool providerPaused();
+    void decodeJob(DecodeItem &item, DecodeContext &context);
+    void streamTile(ReusableTileFetcher &fetcher, const TileJob &job, size_t contentLength, const TileValidators &validators, DecodeContext &context);
+    void revalidatedTile(NetworkTile &tile, MemoryBuffer &&buffer, const String &result, const TileResponse &response);
+    static bool fillStream(TileStream &stream, int32_t end);
+    static void *streamOpen(const char *name, int32_t *size);
+    static void streamClose(void *handle);
+    static int32_t streamRead(PNGFILE *file, uint8_t *dest, int32_t length);
+    static int32_t streamSeek(PNGFILE *file, int32_t position);
+    void makeTileUrl(char *url, size_t size, uint32_t x, uint32_t y, uint8_t zoom);
+    MemoryBuffer readLocalTile(uint32_t x, uint32_t y, uint8_t zoom, TileSource &source, TileValidators &validators);
+    bool decodeTile(DecodeContext &context, DecodeItem &item, String &result);
+    bool runDecoder(DecodeContext &context, int16_t openResult, uint32_t x, uint32_t y, uint8_t zoom, String &result);
+    void storeTile(uint32_t x, uint32_t y, uint8_t zoom, MemoryBuffer &buffer, TileSource source, const TileValidators &validators);
+    bool allocateMap(LGFX_Sprite &mapSprite, uint16_t width, uint16_t height);
+    bool composeMap(LGFX_Sprite &mapSprite, CachedTileList &tilePointers);
+    bool panMap(LGFX_Sprite &mapSprite, CachedTileList &tilePointers);
+    void composeRect(LGFX_Sprite &mapSprite, CachedTileList &tilePointers, const MapRect &rect);
+    int64_t mapLeft() const;
+    int64_t mapTop() const;
+    bool composeProgressiveMap(LGFX_Sprite &mapSprite, CachedTileList &tilePointers, std::vector<MapRect> &drawn);
+    void leaseMapSprite(uint32_t generation);
+    bool finishMap(LGFX_Sprite &mapSprite, std::vector<MapRect> &drawn);
+    void drawCachedTile(LGFX_Sprite &mapSprite, const CachedTile &tile, int drawX, int drawY);
+    void drawMissingTile(LGFX_Sprite &mapSprite, size_t tileIndex, int drawX, int drawY);
+    bool drawParentTile(LGFX_Sprite &mapSprite, uint32_t x, uint32_t y, int levels, int drawX, int drawY);
+    bool drawChildTiles(LGFX_Sprite &mapSprite, uint32_t x, uint32_t y, int drawX, int drawY);
+    static uint16_t averagePixels(uint16_t a, uint16_t b, uint16_t c, uint16_t d);
+    void drawTileProgressive(const TileJob &job, const CachedTile *tile, bool pixelsDone, std::vector<MapRect> &drawn);
+    void drawAttribution(LGFX_Sprite &mapSprite, std::vector<MapRect> &drawn);
+    void clipRect(int drawX, int drawY, int size, std::vector<MapRect> &drawn);
+    void notifyDrawn(const std::vector<MapRect> &drawn);
     static void tileFetcherTask(void *param);
     static void PNGDraw(PNGDRAW *pDraw);
     void invalidateTile(CachedTile *tile);
 
     static inline thread_local OpenStreetMap *currentInstance = nullptr;
-    static inline thread_local uint16_t *currentTileBuffer = nullptr;
+    static inline thread_local DecodeContext *currentContext = nullptr;
+    static inline thread_local TileStream *currentStream = nullptr;
     const TileProvider *currentProvider = &tileProviders[0];
     std::vector<CachedTile> tilesCache;
+    TileCacheIndex tilesIndex;
+    TilePool tilePool;
+    bool tileCropping = false;
+    CompressedTileCache compressedCache;
+    TileDiskCache diskCache;
+    uint32_t currentFrame = 0;
+    int newestTile = -1; // recency list through the slots, empty and evicted slots sit at the oldest end
+    int oldestTile = -1;
+    size_t evictionHand = 0;
+    CachePolicy cachePolicy = CachePolicy::LRU;
+    CacheStats cacheStats = {};
 
     TaskHandle_t ownerTask = nullptr;
+    TaskHandle_t fetcherTasks[OSM_MAX_WORKERS] = {};
+    TaskHandle_t decoderTasks[2] = {}; // one per core at most
     int numberOfWorkers = 0;
+    int numberOfDecoders = 0;
+    std::atomic<int> nextDecoder = 0;
+    QueueHandle_t decodeQueue = nullptr; // DecodeItem pointers from the workers to the decoders
+    std::atomic<uint32_t> statDownloads = 0;
+    std::atomic<uint32_t> statDownloadMS = 0;
+    std::atomic<uint32_t> statDecodes = 0;
+    std::atomic<uint32_t> statDecodeMS = 0;
+    std::atomic<uint32_t> statStallMS = 0;
+    std::atomic<uint32_t> statStreamed = 0;
+    std::atomic<uint32_t> statSuperseded = 0;
+    std::atomic<uint32_t> statCutOff = 0;
+    std::atomic<uint32_t> statHedged = 0;
+    std::atomic<uint32_t> statHedgeWins = 0;
+    std::atomic<uint32_t> statBackedOff = 0;
+    WorkerConfig workerConfig;
     QueueHandle_t jobQueue = nullptr;
+    QueueHandle_t prefetchQueue = nullptr;
+    SemaphoreHandle_t jobSignal = nullptr; // counts the jobs in both queues
+    std::atomic<int> prefetchJobs = 0;
     std::atomic<int> pendingJobs = 0;
     bool tasksStarted = false;
 
+    SemaphoreHandle_t cacheMutex = nullptr; // guards cache bookkeeping, job accounting and composing
+    SemaphoreHandle_t spriteMutex = nullptr; // held while a decoder writes a row into the map sprite
+    uint32_t leasedGeneration = 0;          // map generation the decoders may write into, 0 for none
+    EventGroupHandle_t jobEvents = nullptr;
+    CachedTileList tilePointers;
+    uint32_t lastRequestId = 0;
+    uint32_t asyncRequestId = 0;
+    LGFX_Sprite *asyncSprite = nullptr;
+    MapReadyCallback asyncCallback;
+
+    bool progressiveMode = false;
+    TileDrawnCallback tileDrawnCallback;
+    LGFX_Sprite *progressiveSprite = nullptr;
+    bool directDecode = false;
+    bool cacheDirectTiles = true;
+    bool streamingDecode = false;
+    bool staleWhileRevalidate = false;
+    bool hedging = false;
+    uint8_t hedgePercentile = OSM_HEDGE_PERCENTILE;
+    HedgeSlot hedgeSlots[OSM_HEDGE_SLOTS] = {};
+    uint16_t firstByteMS[OSM_HEDGE_SAMPLES] = {}; // ring of the latest first byte latencies
+    uint32_t firstByteCount = 0;
+    TileFailureCache tileFailures; // guarded by cacheMutex
+    std::atomic<uint32_t> mapGeneration = 0;
+    bool incrementalPan = false;
+    LGFX_Sprite *panSprite = nullptr; // last map composed from complete tiles, nullptr when unknown
+    uint8_t panZoom = 0;
+    uint16_t panWidth = 0;
+    uint16_t panHeight = 0;
+    int64_t panLeft = 0; // world pixel position of the top left map corner
+    int64_t panTop = 0;
+    tileList mapTiles;
+    uint8_t mapZoom = 0;
+
+    bool motionHint = false;
+    double hintLongitude = 0;
+    double hintLatitude = 0;
+    float hintHeading = 0;
+    float hintSpeed = 0;
+    PositionHint positionHistory[OSM_PREFETCH_HISTORY];
+    int positionCount = 0;
+    PrefetchStats prefetchStats = {};
+
+    bool focusSet = false; // jobs are ordered from the focus point instead of the map center
+    double focusLongitude = 0;
+    double focusLatitude = 0;
+    TileWeightCallback tileWeight;
+
     unsigned long mapTimeoutMS = 0; // 0 means no timeout
     unsigned long startJobsMS = 0;
 
-    uint16_t mapWidth = 320;
+    uint16_t mapWidth = 320; // size of the composed map, includes the overscan margins
     uint16_t mapHeight = 240;
+    uint16_t viewWidth = 320; // size set by setSize
+    uint16_t viewHeight = 240;
+
+    uint16_t overscanMargin = 0;
+    LGFX_Sprite backingMap;
+    bool backingReady = false;    // backingMap holds a composed map
+    bool backingComplete = false; // and no tile was missing
+    uint8_t backingZoom = 0;
+    int64_t backingLeft = 0; // world pixel position of the top left backing corner
+    int64_t backingTop = 0;
 
     int16_t startOffsetX = 0;
     int16_t startOffsetY = 0;
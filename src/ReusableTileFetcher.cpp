@@ -22,17 +22,32 @@
     */
 
 #include "ReusableTileFetcher.hpp"
+#include <lwip/sockets.h>
+#include <cerrno>
+#include <climits>
 
-ReusableTileFetcher::ReusableTileFetcher() {}
+ReusableTileFetcher::ReusableTileFetcher() : receiveBuffer(new (std::nothrow) uint8_t[OSM_RECEIVE_BUFFER_SIZE]) {}
 ReusableTileFetcher::~ReusableTileFetcher() { disconnect(); }
 
-void ReusableTileFetcher::sendHttpRequest(const char *host, const char *path)
+void ReusableTileFetcher::sendHttpRequest(const char *host, const char *path, const TileValidators *condition)
 {
     Stream *s = currentIsTLS ? static_cast<Stream *>(&secureClient) : static_cast<Stream *>(&client);
 
     char buf[256];
     snprintf(buf, sizeof(buf), "GET %s HTTP/1.1\r\nHost: %s\r\n", path, host);
     s->print(buf);
+
+    // A stored tile is only sent again when it changed
+    if (condition && condition->etag[0])
+    {
+        snprintf(buf, sizeof(buf), "If-None-Match: %s\r\n", condition->etag);
+        s->print(buf);
+    }
+    if (condition && condition->lastModified[0])
+    {
+        snprintf(buf, sizeof(buf), "If-Modified-Since: %s\r\n", condition->lastModified);
+        s->print(buf);
+    }
     s->print("User-Agent: OpenStreetMap-esp32/1.0 (+https://github.com/CelliesProjects/OpenStreetMap-esp32)\r\nConnection: keep-alive\r\n\r\n");
 }
 
@@ -45,9 +60,19 @@ void ReusableTileFetcher::disconnect()
     currentHost[0] = 0;
     currentPort = 0;
     currentIsTLS = false;
+    receiveStart = 0;
+    receiveEnd = 0;
 }
 
 MemoryBuffer ReusableTileFetcher::fetchToBuffer(const char *url, String &result, unsigned long timeoutMS)
+{
+    TileResponse response = {};
+    bool streamed = false;
+    return fetchOne(url, nullptr, result, timeoutMS, nullptr, 0, response, streamed);
+}
+
+MemoryBuffer ReusableTileFetcher::fetchOne(const char *url, const TileValidators *condition, String &result, unsigned long timeoutMS,
+                                           const StreamCallback &onStream, size_t index, TileResponse &response, bool &streamed)
 {
     char host[OSM_MAX_HOST_LEN];
     char path[OSM_MAX_PATH_LEN];
@@ -67,21 +92,205 @@ MemoryBuffer ReusableTileFetcher::fetchToBuffer(const char *url, String &result,
     if (!ensureConnection(host, port, useTLS, timeoutMS, result))
         return MemoryBuffer::empty();
 
-    sendHttpRequest(host, path);
+    sendHttpRequest(host, path, condition);
 
-    size_t contentLength = 0;
     bool connClose = false;
-
-    if (!readHttpHeaders(contentLength, timeoutMS, result, connClose))
+    auto buffer = readResponse(timeoutMS, result, connClose, response, onStream, index, streamed);
+    if (!buffer.isAllocated() && !streamed && response.statusCode != 304 && !responseSkipped)
     {
         disconnect();
         return MemoryBuffer::empty();
     }
 
+    log_d("fetching %s took %lu ms", url, millis() - startMS);
+
+    // Server requested connection close → drop it
+    if (connClose)
+        disconnect();
+
+    return buffer;
+}
+
+void ReusableTileFetcher::fetchPipelined(const char *const *urls, const TileValidators *const *conditions, size_t count, unsigned long timeoutMS,
+                                         const PipelineCallback &onResponse, const StreamCallback &onStream, const AbortCallback &shouldAbort,
+                                         const FirstByteCallback &onFirstByte)
+{
+    abortCheck = shouldAbort ? &shouldAbort : nullptr;
+    firstByteCheck = onFirstByte ? &onFirstByte : nullptr;
+    size_t next = 0;
+    while (next < count)
+    {
+        String result;
+        TileResponse response = {};
+        if (shouldAbort && shouldAbort(next))
+        {
+            result = "No longer needed";
+            onResponse(next, MemoryBuffer::empty(), result, response);
+            ++next;
+            continue;
+        }
+
+        if (deadlinePassed())
+        {
+            result = "Deadline passed";
+            onResponse(next, MemoryBuffer::empty(), result, response);
+            ++next;
+            continue;
+        }
+
+        // After an abort or a dropped connection the rest is pipelined again on a new one
+        if (count - next > 1 && !pipelineRefusedBy(urls[next]))
+        {
+            const size_t delivered = pipelineRequests(urls, conditions, next, count, timeoutMS, onResponse, onStream);
+            if (delivered > next || responseAborted)
+            {
+                next = delivered;
+                continue;
+            }
+        }
+
+        // What the pipeline could not deliver is fetched on its own
+        responseIndex = next;
+        bool streamed = false;
+        MemoryBuffer buffer = fetchOne(urls[next], conditions ? conditions[next] : nullptr, result, timeoutMS, onStream, next, response, streamed);
+        if (!streamed)
+            onResponse(next, std::move(buffer), result, response);
+        ++next;
+    }
+    abortCheck = nullptr;
+    firstByteCheck = nullptr;
+}
+
+size_t ReusableTileFetcher::pipelineRequests(const char *const *urls, const TileValidators *const *conditions, size_t first, size_t count,
+                                             unsigned long timeoutMS, const PipelineCallback &onResponse, const StreamCallback &onStream)
+{
+    char host[OSM_MAX_HOST_LEN];
+    char path[OSM_MAX_PATH_LEN];
+    uint16_t port;
+    bool useTLS;
+
+    String result;
+    responseAborted = false;
+    if (!parseUrl(urls[first], host, path, port, useTLS) || !ensureConnection(host, port, useTLS, timeoutMS, result))
+        return first;
+
+    // Send every request for the same server up front, the responses arrive in order
+    size_t sent = first;
+    while (sent < count)
+    {
+        char otherHost[OSM_MAX_HOST_LEN];
+        uint16_t otherPort;
+        bool otherTLS;
+        if (!parseUrl(urls[sent], otherHost, path, otherPort, otherTLS) ||
+            strcmp(otherHost, host) || otherPort != port || otherTLS != useTLS)
+            break;
+
+        sendHttpRequest(host, path, conditions ? conditions[sent] : nullptr);
+        ++sent;
+    }
+
+    for (size_t index = first; index < sent; ++index)
+    {
+        [[maybe_unused]] const unsigned long startMS = millis();
+        bool connClose = false;
+        TileResponse response = {};
+        bool streamed = false;
+        result = "";
+        responseIndex = index;
+        MemoryBuffer buffer = readResponse(timeoutMS, result, connClose, response, onStream, index, streamed);
+        if (!buffer.isAllocated() && !streamed && response.statusCode != 304 && !responseSkipped)
+        {
+            disconnect();
+            if (response.statusCode)
+            {
+                onResponse(index, std::move(buffer), result, response); // a real answer, only this tile failed
+                return index + 1;
+            }
+
+            // No answer at all, so the server dropped the connection or the pipeline
+            if (index > first && !deadlinePassed() && !responseAborted)
+            {
+                pipelining = false;
+                snprintf(refusingHost, sizeof(refusingHost), "%s", host);
+                log_w("%s does not answer pipelined requests, fetching one by one", host);
+            }
+            return index;
+        }
+
+        log_d("pipelined response %u of %u took %lu ms", index - first + 1, sent - first, millis() - startMS);
+        if (!streamed)
+            onResponse(index, std::move(buffer), result, response);
+
+        if (connClose)
+        {
+            disconnect();
+            return index + 1;
+        }
+    }
+    return sent;
+}
+
+bool ReusableTileFetcher::pipelineRefusedBy(const char *url)
+{
+    // Another server gets its own chance
+    char host[OSM_MAX_HOST_LEN];
+    char path[OSM_MAX_PATH_LEN];
+    uint16_t port;
+    bool useTLS;
+    if (parseUrl(url, host, path, port, useTLS) && strcmp(host, refusingHost))
+        pipelining = true;
+    return !pipelining;
+}
+
+MemoryBuffer ReusableTileFetcher::readResponse(unsigned long timeoutMS, String &result, bool &connectionClose, TileResponse &response,
+                                               const StreamCallback &onStream, size_t index, bool &streamed)
+{
+    size_t contentLength = 0;
+    bool chunked = false;
+    responseSkipped = false;
+    if (!readHttpHeaders(contentLength, chunked, timeoutMS, result, connectionClose, response))
+    {
+        // Reading past a short error body keeps the connection for the requests behind it
+        if (errorHeadersRead && !connectionClose && !chunked && contentLength <= OSM_MAX_DRAIN_BYTES && drainBody(contentLength, timeoutMS))
+            responseSkipped = true;
+        return MemoryBuffer::empty();
+    }
+
+    // Of two requests for the same tile only the first to answer is read
+    if (firstByteCheck && !(*firstByteCheck)(index))
+    {
+        result = "Another request answered first";
+
+        // Reading past a small body is cheaper than sending the requests behind it again
+        if (!chunked && contentLength <= OSM_MAX_DRAIN_BYTES && drainBody(contentLength, timeoutMS))
+            responseSkipped = true;
+        else
+            connectionClose = true;
+        return MemoryBuffer::empty();
+    }
+
+    // A 304 never has a body, the stored tile is still good
+    if (response.statusCode == 304)
+    {
+        result = "Not modified";
+        return MemoryBuffer::empty();
+    }
+
+    // Without a length up front the tile is collected before decoding
+    if (chunked)
+        return readChunkedBody(timeoutMS, result);
+
     if (contentLength == 0)
     {
         result = "Empty response (Content-Length=0)";
-        disconnect();
+        return MemoryBuffer::empty();
+    }
+
+    if (onStream)
+    {
+        streamed = true;
+        if (!streamBody(contentLength, timeoutMS, onStream, index, response, result))
+            connectionClose = true; // the rest of the body is lost, and the connection with it
         return MemoryBuffer::empty();
     }
 
@@ -89,21 +298,11 @@ MemoryBuffer ReusableTileFetcher::fetchToBuffer(const char *url, String &result,
     if (!buffer.isAllocated())
     {
         result = "Download buffer allocation failed";
-        disconnect();
         return MemoryBuffer::empty();
     }
 
     if (!readBody(buffer, contentLength, timeoutMS, result))
-    {
-        disconnect();
         return MemoryBuffer::empty();
-    }
-
-    log_d("fetching %s took %lu ms", url, millis() - startMS);
-
-    // Server requested connection close → drop it
-    if (connClose)
-        disconnect();
 
     return buffer;
 }
@@ -154,6 +353,12 @@ void ReusableTileFetcher::setSocket(WiFiClient &c)
 
 bool ReusableTileFetcher::ensureConnection(const char *host, uint16_t port, bool useTLS, unsigned long timeoutMS, String &result)
 {
+    if (!receiveBuffer)
+    {
+        result = "Receive buffer allocation failed";
+        return false;
+    }
+
     // If we already have a connection to exact host/port/scheme and it's connected, keep it.
     if ((useTLS == currentIsTLS) && !strcmp(host, currentHost) && (port == currentPort) &&
         ((useTLS && secureClient.connected()) || (!useTLS && client.connected())))
@@ -163,11 +368,18 @@ bool ReusableTileFetcher::ensureConnection(const char *host, uint16_t port, bool
 
     disconnect();
 
-    uint32_t connectTimeout = timeoutMS > 0 ? timeoutMS : OSM_DEFAULT_TIMEOUT_MS;
+    const uint32_t connectTimeout = untilDeadline(timeoutMS > 0 ? timeoutMS : OSM_DEFAULT_TIMEOUT_MS);
+    if (!connectTimeout)
+    {
+        result = "Deadline passed before connecting to ";
+        result += host;
+        return false;
+    }
 
     if (useTLS)
     {
         secureClient.setInsecure();
+        secureClient.setHandshakeTimeout((connectTimeout + 999) / 1000); // whole seconds
         if (!secureClient.connect(host, port, connectTimeout))
         {
             result = "TLS connect failed to ";
@@ -194,38 +406,86 @@ bool ReusableTileFetcher::ensureConnection(const char *host, uint16_t port, bool
     return true;
 }
 
-bool ReusableTileFetcher::readHttpHeaders(size_t &contentLength, unsigned long timeoutMS, String &result, bool &connectionClose)
+bool ReusableTileFetcher::waitForResponse(unsigned long timeoutMS)
+{
+    responseAborted = false;
+    if (!abortCheck || receiveStart < receiveEnd)
+        return true; // readLine waits for the status line
+
+    // A response that is no longer wanted is given up while the server has not started it
+    const unsigned long startMS = millis();
+    while (true)
+    {
+        const unsigned long elapsedMS = millis() - startMS;
+        if (elapsedMS >= timeoutMS)
+            return false;
+
+        if (waitForData(std::min(timeoutMS - elapsedMS, OSM_ABORT_POLL_MS)))
+            return true;
+
+        if (deadlinePassed() || !(currentIsTLS ? secureClient.connected() : client.connected()))
+            return false;
+
+        if ((*abortCheck)(responseIndex))
+        {
+            responseAborted = true;
+            return false;
+        }
+    }
+}
+
+bool ReusableTileFetcher::readHttpHeaders(size_t &contentLength, bool &chunked, unsigned long timeoutMS, String &result, bool &connectionClose, TileResponse &response)
 {
     contentLength = 0;
+    chunked = false;
+    int &statusCode = response.statusCode;
+    statusCode = 0;
+    response.validators = {};
+    response.retryAfter = 0;
     bool start = true;
     connectionClose = false;
     bool pngFound = false;
+    long maxAge = -1; // seconds, -1 when not sent
+    uint32_t serverDate = 0;
+    uint32_t expiresDate = 0;
+    uint32_t retryDate = 0;
+    bool httpError = false;
+    errorHeadersRead = false;
 
-    uint32_t headerTimeout = timeoutMS > 0 ? timeoutMS : OSM_DEFAULT_TIMEOUT_MS;
+    const unsigned long headerTimeout = timeoutMS > 0 ? timeoutMS : OSM_DEFAULT_TIMEOUT_MS;
+    const unsigned long startMS = millis();
 
-    while ((currentIsTLS ? secureClient.connected() : client.connected()))
+    if (!waitForResponse(headerTimeout))
     {
-        if (!readLineWithTimeout(headerTimeout))
+        result = responseAborted ? "Aborted before the response started" : "No response or timeout";
+        return false;
+    }
+
+    while (true)
+    {
+        const unsigned long elapsedMS = millis() - startMS;
+        char *line = elapsedMS < headerTimeout ? readLine(headerTimeout - elapsedMS) : nullptr;
+        if (!line)
         {
-            result = "Header error or timeout";
+            if (!httpError)
+                result = "Header error or timeout";
             return false;
         }
 
-        log_d("read header: %s", headerLine);
+        log_d("read header: %s", line);
 
         if (start)
         {
-            if (strncmp(headerLine, "HTTP/1.", 7) != 0)
+            if (strncmp(line, "HTTP/1.", 7) != 0)
             {
                 result = "Bad HTTP response: ";
-                result += headerLine;
+                result += line;
                 return false;
             }
 
             // parse status code
-            int statusCode = 0;
             const char *reasonPhrase = "";
-            const char *sp1 = strchr(headerLine, ' ');
+            const char *sp1 = strchr(line, ' ');
             if (sp1)
             {
                 const char *p = sp1 + 1;
@@ -240,7 +500,7 @@ bool ReusableTileFetcher::readHttpHeaders(size_t &contentLength, unsigned long t
                     reasonPhrase = p + 1;
             }
 
-            if (statusCode != 200)
+            if (statusCode != 200 && statusCode != 304)
             {
                 result = "HTTP error ";
                 result += statusCode;
@@ -250,42 +510,114 @@ bool ReusableTileFetcher::readHttpHeaders(size_t &contentLength, unsigned long t
                     result += reasonPhrase;
                     result += ")";
                 }
-                return false;
+                httpError = true; // the headers are still read for a Retry-After
             }
 
             start = false;
         }
 
-        if (headerLine[0] == '\0') // empty line = end of headers
+        if (line[0] == '\0') // empty line = end of headers
             break;
 
         // parse headers
-        if (strncasecmp(headerLine, "content-length:", 15) == 0)
+        if (strncasecmp(line, "content-length:", 15) == 0)
         {
-            const char *val = headerLine + 15;
+            const char *val = line + 15;
             while (*val == ' ' || *val == '\t')
                 val++;
             contentLength = atoi(val);
         }
-        else if (strncasecmp(headerLine, "connection:", 11) == 0)
+        else if (strncasecmp(line, "connection:", 11) == 0)
         {
-            const char *val = headerLine + 11;
+            const char *val = line + 11;
             while (*val == ' ' || *val == '\t')
                 val++;
             if (strcasecmp(val, "close") == 0)
                 connectionClose = true;
         }
-        else if (strncasecmp(headerLine, "content-type:", 13) == 0)
+        else if (strncasecmp(line, "content-type:", 13) == 0)
         {
-            const char *val = headerLine + 13;
+            const char *val = line + 13;
             while (*val == ' ' || *val == '\t')
                 val++;
             if (strcasecmp(val, "image/png") == 0)
                 pngFound = true;
         }
+        else if (strncasecmp(line, "transfer-encoding:", 18) == 0)
+        {
+            // chunked is always the last coding applied
+            const size_t len = strlen(line);
+            if (len >= 25 && strcasecmp(line + len - 7, "chunked") == 0)
+                chunked = true;
+        }
+        else if (strncasecmp(line, "etag:", 5) == 0)
+        {
+            const char *val = line + 5;
+            while (*val == ' ' || *val == '\t')
+                val++;
+            if (strlen(val) < sizeof(response.validators.etag))
+                snprintf(response.validators.etag, sizeof(response.validators.etag), "%s", val);
+        }
+        else if (strncasecmp(line, "last-modified:", 14) == 0)
+        {
+            const char *val = line + 14;
+            while (*val == ' ' || *val == '\t')
+                val++;
+            if (strlen(val) < sizeof(response.validators.lastModified))
+                snprintf(response.validators.lastModified, sizeof(response.validators.lastModified), "%s", val);
+        }
+        else if (strncasecmp(line, "cache-control:", 14) == 0)
+        {
+            const char *val = line + 14;
+            const char *age = strstr(val, "max-age=");
+            if (strstr(val, "no-cache") || strstr(val, "no-store"))
+                maxAge = 0;
+            else if (age && (age == val || age[-1] == ' ' || age[-1] == ','))
+                maxAge = atol(age + 8);
+        }
+        else if (strncasecmp(line, "expires:", 8) == 0)
+            expiresDate = parseHttpDate(line + 8);
+        else if (strncasecmp(line, "date:", 5) == 0)
+            serverDate = parseHttpDate(line + 5);
+        else if (strncasecmp(line, "retry-after:", 12) == 0)
+        {
+            // Either seconds or an HTTP date
+            const char *val = line + 12;
+            while (*val == ' ' || *val == '\t')
+                val++;
+            if (isdigit((unsigned char)*val))
+                response.retryAfter = strtoul(val, nullptr, 10);
+            else
+                retryDate = parseHttpDate(val);
+        }
+    }
+
+    if (serverDate)
+    {
+        serverTime = serverDate;
+        serverTimeMS = millis();
+    }
+
+    const uint32_t retryFrom = serverDate ? serverDate : unixTime();
+    if (retryDate && retryFrom)
+        response.retryAfter = retryDate > retryFrom ? retryDate - retryFrom : 0;
+
+    if (httpError)
+    {
+        errorHeadersRead = true;
+        return false;
     }
 
-    if (!pngFound)
+    // max-age wins over Expires, which is relative to the server clock
+    const uint32_t now = unixTime();
+    uint32_t lifetime = OSM_DEFAULT_MAX_AGE;
+    if (maxAge >= 0)
+        lifetime = maxAge;
+    else if (expiresDate && serverDate)
+        lifetime = expiresDate > serverDate ? expiresDate - serverDate : 0;
+    response.validators.expires = now ? now + lifetime : 0;
+
+    if (!pngFound && statusCode != 304)
     {
         result = "Content-Type not PNG";
         return false;
@@ -294,100 +626,362 @@ bool ReusableTileFetcher::readHttpHeaders(size_t &contentLength, unsigned long t
     return true;
 }
 
-bool ReusableTileFetcher::readBody(MemoryBuffer &buffer, size_t contentLength, unsigned long timeoutMS, String &result)
+uint32_t ReusableTileFetcher::unixTime()
 {
-    uint8_t *dest = buffer.get();
-    size_t readSize = 0;
-    unsigned long lastReadTime = millis();
+    const time_t now = time(nullptr);
+    if (now > OSM_CLOCK_VALID_AFTER)
+        return now;
 
-    const unsigned long maxStall = timeoutMS > 0 ? timeoutMS : OSM_DEFAULT_TIMEOUT_MS;
+    // Without a set clock the last server date is followed
+    const uint32_t date = serverTime.load();
+    return date ? date + (millis() - serverTimeMS.load()) / 1000 : 0;
+}
 
-    if (currentIsTLS)
-        secureClient.setTimeout(maxStall);
-    else
-        client.setTimeout(maxStall);
+uint32_t ReusableTileFetcher::parseHttpDate(const char *date)
+{
+    // IMF-fixdate as in "Sun, 06 Nov 1994 08:49:37 GMT"
+    static const char months[] = "JanFebMarAprMayJunJulAugSepOctNovDec";
+    int day, year, hour, minute, second;
+    char month[4];
+    const char *comma = strchr(date, ',');
+    if (!comma || sscanf(comma + 1, "%d %3s %d %d:%d:%d", &day, month, &year, &hour, &minute, &second) != 6)
+        return 0;
+
+    const char *found = strstr(months, month);
+    if (!found || strlen(month) != 3 || year < 1970)
+        return 0;
+
+    // Days since 1970-01-01 in the proleptic Gregorian calendar
+    int m = (found - months) / 3 + 1;
+    const int y = year - (m <= 2);
+    const int era = y / 400;
+    const int yearOfEra = y - era * 400;
+    m = m > 2 ? m - 3 : m + 9;
+    const int dayOfYear = (153 * m + 2) / 5 + day - 1;
+    const int dayOfEra = yearOfEra * 365 + yearOfEra / 4 - yearOfEra / 100 + dayOfYear;
+    const int64_t days = static_cast<int64_t>(era) * 146097 + dayOfEra - 719468;
+    return days * 86400 + hour * 3600 + minute * 60 + second;
+}
+
+void ReusableTileFetcher::setDeadline(unsigned long startMS, unsigned long budgetMS)
+{
+    deadlineStartMS = startMS;
+    deadlineBudgetMS = budgetMS;
+}
+
+bool ReusableTileFetcher::deadlinePassed() const
+{
+    return deadlineBudgetMS && millis() - deadlineStartMS >= deadlineBudgetMS;
+}
+
+unsigned long ReusableTileFetcher::untilDeadline(unsigned long timeoutMS) const
+{
+    if (!deadlineBudgetMS)
+        return timeoutMS;
+
+    const unsigned long elapsedMS = millis() - deadlineStartMS;
+    return elapsedMS < deadlineBudgetMS ? std::min(timeoutMS, deadlineBudgetMS - elapsedMS) : 0;
+}
+
+bool ReusableTileFetcher::waitForData(unsigned long timeoutMS)
+{
+    // A slow trickle never stalls, so the deadline also holds while data keeps arriving
+    if (deadlinePassed())
+        return false;
+
+    timeoutMS = untilDeadline(timeoutMS);
+    const unsigned long startMS = millis();
+    while (true)
+    {
+        if (currentIsTLS ? secureClient.available() : client.available())
+            return true;
+
+        const unsigned long elapsedMS = millis() - startMS;
+        const int fd = currentIsTLS ? secureClient.fd() : client.fd();
+        if (elapsedMS >= timeoutMS || fd < 0)
+            return false;
+
+        // Sleep in the network stack until the socket is readable
+        const unsigned long waitMS = timeoutMS - elapsedMS;
+        fd_set readable;
+        FD_ZERO(&readable);
+        FD_SET(fd, &readable);
+        timeval timeout = {static_cast<time_t>(waitMS / 1000), static_cast<suseconds_t>((waitMS % 1000) * 1000)};
+        const int ready = select(fd + 1, &readable, nullptr, nullptr, &timeout);
+        if (ready < 0)
+            return false;
+
+        // Readable without data is either a closed connection or a TLS record that is not complete yet
+        if (ready > 0 && !(currentIsTLS ? secureClient.available() : client.available()) &&
+            !(currentIsTLS ? secureClient.connected() : client.connected()))
+            return false;
+    }
+}
 
-    while (readSize < contentLength)
+bool ReusableTileFetcher::receive(unsigned long timeoutMS)
+{
+    // Unread bytes are kept, moved to the front when the buffer end is reached
+    if (receiveStart == receiveEnd)
+        receiveStart = receiveEnd = 0;
+    else if (receiveStart > 0 && receiveEnd == OSM_RECEIVE_BUFFER_SIZE)
     {
-        size_t availableData = currentIsTLS ? secureClient.available() : client.available();
-        if (availableData == 0)
+        memmove(receiveBuffer.get(), receiveBuffer.get() + receiveStart, receiveEnd - receiveStart);
+        receiveEnd -= receiveStart;
+        receiveStart = 0;
+    }
+
+    if (!waitForData(timeoutMS))
+        return false;
+
+    uint8_t *dest = receiveBuffer.get() + receiveEnd;
+    const size_t space = OSM_RECEIVE_BUFFER_SIZE - receiveEnd;
+    const int bytesRead = currentIsTLS ? secureClient.read(dest, space) : client.read(dest, space);
+    if (bytesRead <= 0)
+        return false;
+
+    receiveEnd += bytesRead;
+    return true;
+}
+
+char *ReusableTileFetcher::readLine(unsigned long timeoutMS)
+{
+    const unsigned long startMS = millis();
+    size_t scanned = 0; // bytes after receiveStart already searched for the line end
+    bool skipping = false;
+
+    while (true)
+    {
+        uint8_t *begin = receiveBuffer.get() + receiveStart;
+        uint8_t *newline = static_cast<uint8_t *>(memchr(begin + scanned, '\n', receiveEnd - receiveStart - scanned));
+        if (newline)
         {
-            if (millis() - lastReadTime >= maxStall)
+            receiveStart = newline - receiveBuffer.get() + 1;
+            if (skipping)
             {
-                result = "Timeout: body read stalled for ";
-                result += maxStall;
-                result += " ms";
-                disconnect();
-                return false;
+                // We were discarding an oversized line → keep going with the next one
+                skipping = false;
+                scanned = 0;
+                continue;
             }
-            taskYIELD();
-            continue;
+
+            // The line is terminated in place and parsed from the receive buffer
+            if (newline > begin && newline[-1] == '\r')
+                --newline;
+            *newline = '\0';
+            return reinterpret_cast<char *>(begin);
         }
+        scanned = receiveEnd - receiveStart;
 
-        size_t remaining = contentLength - readSize;
-        size_t toRead = std::min(availableData, remaining);
+        if (scanned == OSM_RECEIVE_BUFFER_SIZE)
+        {
+            // buffer too small → switch to skipping mode
+            skipping = true;
+            receiveStart = receiveEnd = 0;
+            scanned = 0;
+        }
+
+        const unsigned long elapsedMS = millis() - startMS;
+        if (elapsedMS >= timeoutMS || !receive(timeoutMS - elapsedMS))
+            return nullptr;
+    }
+}
+
+bool ReusableTileFetcher::readBody(MemoryBuffer &buffer, size_t contentLength, unsigned long timeoutMS, String &result)
+{
+    const unsigned long maxStall = timeoutMS > 0 ? timeoutMS : OSM_DEFAULT_TIMEOUT_MS;
+    return readBytes(buffer.get(), contentLength, maxStall, result);
+}
 
-        int bytesRead = currentIsTLS
-                            ? secureClient.readBytes(dest + readSize, toRead)
-                            : client.readBytes(dest + readSize, toRead);
+bool ReusableTileFetcher::drainBody(size_t contentLength, unsigned long timeoutMS)
+{
+    const unsigned long maxStall = timeoutMS > 0 ? timeoutMS : OSM_DEFAULT_TIMEOUT_MS;
+    size_t skipped = std::min(contentLength, receiveEnd - receiveStart);
+    receiveStart += skipped;
+    if (receiveStart < receiveEnd)
+        return true;
 
+    // Nothing is left in the receive buffer, so it takes the dropped bytes
+    receiveStart = receiveEnd = 0;
+    while (skipped < contentLength)
+    {
+        if (!waitForData(maxStall))
+            return false;
+
+        const size_t length = std::min(contentLength - skipped, OSM_RECEIVE_BUFFER_SIZE);
+        const int bytesRead = currentIsTLS
+                                  ? secureClient.read(receiveBuffer.get(), length)
+                                  : client.read(receiveBuffer.get(), length);
         if (bytesRead > 0)
-        {
-            readSize += bytesRead;
-            lastReadTime = millis();
-        }
-        else
-            taskYIELD();
+            skipped += bytesRead;
     }
     return true;
 }
 
-bool ReusableTileFetcher::readLineWithTimeout(uint32_t timeoutMs)
+MemoryBuffer ReusableTileFetcher::readChunkedBody(unsigned long timeoutMS, String &result)
 {
-    size_t len = 0;
-    const uint32_t start = millis();
-    bool skipping = false;
+    const unsigned long maxStall = timeoutMS > 0 ? timeoutMS : OSM_DEFAULT_TIMEOUT_MS;
+    MemoryBuffer body = MemoryBuffer::empty();
+    size_t bodySize = 0;
 
-    while ((millis() - start) < timeoutMs)
+    while (true)
     {
-        int availableData = currentIsTLS ? secureClient.available() : client.available();
-        if (availableData)
+        const char *line = readLine(maxStall);
+        if (!line)
         {
-            char c = currentIsTLS ? secureClient.read() : client.read();
-            if (c == '\r')
-                continue;
+            result = "Chunk size error or timeout";
+            return MemoryBuffer::empty();
+        }
 
-            if (c == '\n')
-            {
-                if (skipping)
-                {
-                    // We were discarding an oversized line → reset and keep going
-                    len = 0;
-                    skipping = false;
-                    continue; // stay in loop, keep reading next line
-                }
+        // Only hex digits, optionally followed by chunk extensions; strtoul alone would take signs, "0x" and overflow
+        char *end;
+        errno = 0;
+        const unsigned long parsedSize = isxdigit((unsigned char)line[0]) ? strtoul(line, &end, 16) : ULONG_MAX;
+        if (parsedSize == ULONG_MAX || errno == ERANGE || (*end && *end != ';' && *end != ' ' && *end != '\t'))
+        {
+            result = "Bad chunk size: ";
+            result += line;
+            return MemoryBuffer::empty();
+        }
+        const size_t chunkSize = parsedSize;
 
-                headerLine[len] = '\0';
-                return true; // got a usable line
-            }
+        if (chunkSize == 0)
+            break;
 
-            if (!skipping)
+        // Written so the sum can not wrap around
+        if (chunkSize > OSM_MAX_CHUNKED_BODY - bodySize)
+        {
+            result = "Chunked body too large";
+            return MemoryBuffer::empty();
+        }
+
+        // Grow in steps, so a body of many small chunks is not copied for every chunk
+        if (bodySize + chunkSize > body.size())
+        {
+            const size_t step = std::min(std::max(body.size() * 2, OSM_CHUNKED_BODY_START), OSM_MAX_CHUNKED_BODY);
+            MemoryBuffer bigger(std::max(bodySize + chunkSize, step));
+            if (!bigger.isAllocated())
             {
-                if (len < sizeof(headerLine) - 1)
-                {
-                    headerLine[len++] = c;
-                }
-                else
-                {
-                    // buffer too small → switch to skipping mode
-                    skipping = true;
-                    len = 0; // clear partial junk
-                }
+                result = "Download buffer allocation failed";
+                return MemoryBuffer::empty();
             }
+            if (bodySize)
+                memcpy(bigger.get(), body.get(), bodySize);
+            body = std::move(bigger);
         }
-        else
-            taskYIELD();
+
+        if (!readBytes(body.get() + bodySize, chunkSize, maxStall, result))
+            return MemoryBuffer::empty();
+        bodySize += chunkSize;
+
+        line = readLine(maxStall); // the line end closing the chunk
+        if (!line || *line)
+        {
+            result = "Bad chunk end";
+            return MemoryBuffer::empty();
+        }
+    }
+
+    // Trailer fields end with an empty line
+    const char *line;
+    while ((line = readLine(maxStall)) && *line)
+        ;
+    if (!line)
+    {
+        result = "Chunk trailer error or timeout";
+        return MemoryBuffer::empty();
+    }
+
+    if (!bodySize)
+    {
+        result = "Empty chunked response";
+        return MemoryBuffer::empty();
+    }
+
+    body.truncate(bodySize);
+    return body;
+}
+
+bool ReusableTileFetcher::streamBody(size_t contentLength, unsigned long timeoutMS, const StreamCallback &onStream, size_t index,
+                                     const TileResponse &response, String &result)
+{
+    streamRemaining = contentLength;
+    streamTimeoutMS = timeoutMS > 0 ? timeoutMS : OSM_DEFAULT_TIMEOUT_MS;
+    streamFailed = false;
+
+    onStream(index, contentLength, response);
+
+    // The decoder can stop before the end of the body, the next response starts after it
+    uint8_t scratch[256];
+    while (streamRemaining && readStream(scratch, std::min(sizeof(scratch), streamRemaining)))
+        ;
+
+    streamRemaining = 0;
+    if (streamFailed)
+        result = "Stream broken off";
+    return !streamFailed;
+}
+
+bool ReusableTileFetcher::readStream(uint8_t *dest, size_t length)
+{
+    if (streamFailed || length > streamRemaining)
+        return false;
+
+    if (abortCheck && streamRemaining >= OSM_ABORT_MIN_REMAINING && (*abortCheck)(responseIndex))
+    {
+        log_d("stream aborted, no longer needed");
+        disconnect();
+        streamFailed = true;
+        return false;
     }
 
-    return false; // timeout
+    String result;
+    if (!readBytes(dest, length, streamTimeoutMS, result))
+    {
+        log_w("%s", result.c_str());
+        streamFailed = true;
+        return false;
+    }
+    streamRemaining -= length;
+    return true;
+}
+
+bool ReusableTileFetcher::readBytes(uint8_t *dest, size_t length, unsigned long maxStall, String &result)
+{
+    // Bytes that arrived with the headers come first
+    size_t readSize = std::min(length, receiveEnd - receiveStart);
+    memcpy(dest, receiveBuffer.get() + receiveStart, readSize);
+    receiveStart += readSize;
+
+    // The rest goes straight from the socket to its destination
+    while (readSize < length)
+    {
+        // Dropping a response costs the connection, so only long ones are cut off
+        if (abortCheck && length - readSize >= OSM_ABORT_MIN_REMAINING && (*abortCheck)(responseIndex))
+        {
+            result = "Aborted, no longer needed";
+            disconnect();
+            return false;
+        }
+
+        if (!waitForData(maxStall))
+        {
+            if (deadlinePassed())
+                result = "Deadline passed while reading the body";
+            else
+            {
+                result = "Body read stalled for ";
+                result += maxStall;
+                result += " ms or the connection closed";
+            }
+            disconnect();
+            return false;
+        }
+
+        const int bytesRead = currentIsTLS
+                                  ? secureClient.read(dest + readSize, length - readSize)
+                                  : client.read(dest + readSize, length - readSize);
+        if (bytesRead > 0)
+            readSize += bytesRead;
+    }
+    return true;
 }
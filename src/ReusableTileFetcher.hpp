@@ -26,12 +26,35 @@
 #include <WiFiClient.h>
 #include <WiFiClientSecure.h>
 #include <memory>
+#include <functional>
+#include <atomic>
+#include <time.h>
 #include "MemoryBuffer.hpp"
+#include "TileValidators.hpp"
 
-constexpr int OSM_MAX_HEADERLENGTH = 64;
+constexpr size_t OSM_RECEIVE_BUFFER_SIZE = 1024; // also the longest header line that is parsed
 constexpr int OSM_MAX_HOST_LEN = 128;
 constexpr int OSM_MAX_PATH_LEN = 128;
 constexpr int OSM_DEFAULT_TIMEOUT_MS = 5000;
+constexpr int OSM_PIPELINE_DEPTH = 4; // requests sent before the first response is read
+constexpr size_t OSM_CHUNKED_BODY_START = 16 * 1024;
+constexpr size_t OSM_MAX_CHUNKED_BODY = 256 * 1024;
+constexpr size_t OSM_ABORT_MIN_REMAINING = 8 * 1024; // smaller rests are cheaper to read than a new connection
+constexpr unsigned long OSM_ABORT_POLL_MS = 20;      // how often a response that did not start yet is checked for an abort
+constexpr size_t OSM_MAX_DRAIN_BYTES = 32 * 1024;    // a dropped body up to this size is read past to keep the connection
+constexpr time_t OSM_CLOCK_VALID_AFTER = 1577836800; // 2020-01-01, earlier means the clock was never set
+
+struct TileResponse
+{
+    int statusCode; // 0 when the server did not answer, 304 when a conditional request found the tile unchanged
+    TileValidators validators;
+    uint32_t retryAfter; // seconds a 429 or 503 asked to wait, 0 when not sent
+};
+
+using PipelineCallback = std::function<void(size_t index, MemoryBuffer &&buffer, const String &result, const TileResponse &response)>;
+using StreamCallback = std::function<void(size_t index, size_t contentLength, const TileResponse &response)>; // reads the body with readStream
+using AbortCallback = std::function<bool(size_t index)>;                                                       // true when a response is no longer wanted
+using FirstByteCallback = std::function<bool(size_t index)>;                                                   // false drops a response that just started
 
 class ReusableTileFetcher
 {
@@ -43,21 +66,62 @@ public:
     ReusableTileFetcher &operator=(const ReusableTileFetcher &) = delete;
 
     MemoryBuffer fetchToBuffer(const char *url, String &result, unsigned long timeoutMS);
+    void fetchPipelined(const char *const *urls, const TileValidators *const *conditions, size_t count, unsigned long timeoutMS,
+                        const PipelineCallback &onResponse, const StreamCallback &onStream = nullptr, const AbortCallback &shouldAbort = nullptr,
+                        const FirstByteCallback &onFirstByte = nullptr);
+    bool readStream(uint8_t *dest, size_t length);
+    void setDeadline(unsigned long startMS, unsigned long budgetMS); // budgetMS 0 clears the deadline
     void disconnect();
+    static uint32_t unixTime();
 
 private:
     WiFiClient client;
     WiFiClientSecure secureClient;
     bool currentIsTLS = false;
     char currentHost[OSM_MAX_HOST_LEN] = {0};
-    char headerLine[OSM_MAX_HEADERLENGTH] = {0};
+    std::unique_ptr<uint8_t[]> receiveBuffer; // socket data not parsed or read yet
+    size_t receiveStart = 0;
+    size_t receiveEnd = 0;
     uint16_t currentPort = 0;
+    bool pipelining = true; // cleared when refusingHost drops pipelined requests
+    char refusingHost[OSM_MAX_HOST_LEN] = {0};
+    size_t streamRemaining = 0; // body bytes of the streamed response not read yet
+    unsigned long streamTimeoutMS = 0;
+    bool streamFailed = false;
+    const AbortCallback *abortCheck = nullptr; // set while fetchPipelined runs
+    size_t responseIndex = 0;                  // response abortCheck is asked about
+    bool responseAborted = false;              // abortCheck gave up the response before it started
+    bool responseSkipped = false;              // the response was dropped or an error, its body was read past
+    bool errorHeadersRead = false;             // readHttpHeaders read all headers of an error response
+    const FirstByteCallback *firstByteCheck = nullptr;
+    unsigned long deadlineStartMS = 0;         // every connect and read ends at the deadline
+    unsigned long deadlineBudgetMS = 0;
+    static inline std::atomic<uint32_t> serverTime = 0; // last Date header, keeps time when the clock is not set
+    static inline std::atomic<uint32_t> serverTimeMS = 0;
     void setSocket(WiFiClient &c);
 
     bool parseUrl(const char *url, char *host, char *path, uint16_t &port, bool &useTLS);
     bool ensureConnection(const char *host, uint16_t port, bool useTLS, unsigned long timeoutMS, String &result);
-    void sendHttpRequest(const char *host, const char *path);
-    bool readHttpHeaders(size_t &contentLength, unsigned long timeoutMS, String &result, bool &connectionClose);
-    bool readLineWithTimeout(uint32_t timeoutMs);
+    void sendHttpRequest(const char *host, const char *path, const TileValidators *condition);
+    bool pipelineRefusedBy(const char *url);
+    MemoryBuffer fetchOne(const char *url, const TileValidators *condition, String &result, unsigned long timeoutMS,
+                          const StreamCallback &onStream, size_t index, TileResponse &response, bool &streamed);
+    size_t pipelineRequests(const char *const *urls, const TileValidators *const *conditions, size_t first, size_t count,
+                            unsigned long timeoutMS, const PipelineCallback &onResponse, const StreamCallback &onStream);
+    MemoryBuffer readResponse(unsigned long timeoutMS, String &result, bool &connectionClose, TileResponse &response,
+                              const StreamCallback &onStream, size_t index, bool &streamed);
+    bool streamBody(size_t contentLength, unsigned long timeoutMS, const StreamCallback &onStream, size_t index,
+                    const TileResponse &response, String &result);
+    bool waitForResponse(unsigned long timeoutMS);
+    bool readHttpHeaders(size_t &contentLength, bool &chunked, unsigned long timeoutMS, String &result, bool &connectionClose, TileResponse &response);
+    static uint32_t parseHttpDate(const char *date);
+    bool deadlinePassed() const;
+    unsigned long untilDeadline(unsigned long timeoutMS) const;
+    bool waitForData(unsigned long timeoutMS);
+    bool receive(unsigned long timeoutMS);
+    char *readLine(unsigned long timeoutMS);
     bool readBody(MemoryBuffer &buffer, size_t contentLength, unsigned long timeoutMS, String &result);
+    bool drainBody(size_t contentLength, unsigned long timeoutMS);
+    MemoryBuffer readChunkedBody(unsigned long timeoutMS, String &result);
+    bool readBytes(uint8_t *dest, size_t length, unsigned long maxStall, String &result);
 };
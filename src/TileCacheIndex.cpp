@@ -0,0 +1,104 @@
+/*
+    Copyright (c) 2025 Cellie https://github.com/CelliesProjects/OpenStreetMap-esp32
+
+    Permission is hereby granted, free of charge, to any person obtaining a copy
+    of this software and associated documentation files (the "Software"), to deal
+    in the Software without restriction, including without limitation the rights
+    to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+    copies of the Software, and to permit persons to whom the Software is
+    furnished to do so, subject to the following conditions:
+
+    The above copyright notice and this permission notice shall be included in all
+    copies or substantial portions of the Software.
+
+    THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+    IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+    FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+    AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+    LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+    OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+    SOFTWARE.
+    SPDX-License-Identifier: MIT
+    */
+
+#include "TileCacheIndex.hpp"
+
+void TileCacheIndex::reserve(size_t numberOfSlots)
+{
+    // keep the load factor at or below 50% so probe sequences stay short
+    size_t capacity = 8;
+    while (capacity < numberOfSlots * 2)
+        capacity <<= 1;
+
+    entries.assign(capacity, {EMPTY_KEY, -1});
+    mask = capacity - 1;
+}
+
+void TileCacheIndex::clear()
+{
+    std::vector<Entry>().swap(entries);
+    mask = 0;
+}
+
+size_t TileCacheIndex::home(uint64_t key) const
+{
+    // Fibonacci hashing spreads neighbouring tiles over the table
+    return static_cast<size_t>((key * 0x9E3779B97F4A7C15ULL) >> 32) & mask;
+}
+
+int TileCacheIndex::find(uint64_t key) const
+{
+    if (entries.empty())
+        return -1;
+
+    for (size_t i = home(key);; i = (i + 1) & mask)
+    {
+        if (entries[i].key == key)
+            return entries[i].slot;
+        if (entries[i].key == EMPTY_KEY)
+            return -1;
+    }
+}
+
+bool TileCacheIndex::insert(uint64_t key, int slot)
+{
+    if (entries.empty())
+        return false;
+
+    for (size_t i = home(key);; i = (i + 1) & mask)
+    {
+        if (entries[i].key == key || entries[i].key == EMPTY_KEY)
+        {
+            entries[i] = {key, slot};
+            return true;
+        }
+    }
+}
+
+void TileCacheIndex::erase(uint64_t key)
+{
+    if (entries.empty())
+        return;
+
+    size_t i = home(key);
+    while (entries[i].key != key)
+    {
+        if (entries[i].key == EMPTY_KEY)
+            return;
+        i = (i + 1) & mask;
+    }
+
+    // backward shift deletion keeps probe chains intact without tombstones
+    size_t hole = i;
+    for (size_t j = (i + 1) & mask; entries[j].key != EMPTY_KEY; j = (j + 1) & mask)
+    {
+        const size_t wanted = home(entries[j].key);
+        const bool movable = (hole <= j) ? (wanted <= hole || wanted > j) : (wanted <= hole && wanted > j);
+        if (movable)
+        {
+            entries[hole] = entries[j];
+            hole = j;
+        }
+    }
+    entries[hole] = {EMPTY_KEY, -1};
+}
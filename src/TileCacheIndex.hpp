@@ -0,0 +1,61 @@
+/*
+    Copyright (c) 2025 Cellie https://github.com/CelliesProjects/OpenStreetMap-esp32
+
+    Permission is hereby granted, free of charge, to any person obtaining a copy
+    of this software and associated documentation files (the "Software"), to deal
+    in the Software without restriction, including without limitation the rights
+    to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+    copies of the Software, and to permit persons to whom the Software is
+    furnished to do so, subject to the following conditions:
+
+    The above copyright notice and this permission notice shall be included in all
+    copies or substantial portions of the Software.
+
+    THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+    IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+    FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+    AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+    LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+    OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+    SOFTWARE.
+    SPDX-License-Identifier: MIT
+    */
+
+#ifndef TILECACHEINDEX_HPP_
+#define TILECACHEINDEX_HPP_
+
+#include <Arduino.h>
+#include <vector>
+
+// Open addressing hash index mapping packed (z,x,y) keys to tile cache slots
+class TileCacheIndex
+{
+public:
+    static constexpr uint64_t makeKey(uint32_t x, uint32_t y, uint8_t z)
+    {
+        return (static_cast<uint64_t>(z) << 56) | (static_cast<uint64_t>(x & 0x0FFFFFFF) << 28) | (y & 0x0FFFFFFF);
+    }
+
+    void reserve(size_t numberOfSlots);
+    void clear();
+
+    int find(uint64_t key) const;
+    bool insert(uint64_t key, int slot);
+    void erase(uint64_t key);
+
+private:
+    static constexpr uint64_t EMPTY_KEY = UINT64_MAX;
+
+    struct Entry
+    {
+        uint64_t key;
+        int slot;
+    };
+
+    std::vector<Entry> entries;
+    size_t mask = 0;
+
+    size_t home(uint64_t key) const;
+};
+
+#endif
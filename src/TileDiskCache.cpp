@@ -0,0 +1,564 @@
+/*
+    Copyright (c) 2025 Cellie https://github.com/CelliesProjects/OpenStreetMap-esp32
+
+    Permission is hereby granted, free of charge, to any person obtaining a copy
+    of this software and associated documentation files (the "Software"), to deal
+    in the Software without restriction, including without limitation the rights
+    to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+    copies of the Software, and to permit persons to whom the Software is
+    furnished to do so, subject to the following conditions:
+
+    The above copyright notice and this permission notice shall be included in all
+    copies or substantial portions of the Software.
+
+    THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+    IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+    FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+    AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+    LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+    OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+    SOFTWARE.
+    SPDX-License-Identifier: MIT
+    */
+
+#include "TileDiskCache.hpp"
+#include <algorithm>
+#include <numeric>
+
+namespace
+{
+    constexpr uint64_t RESCAN_KEY = UINT64_MAX;
+
+    uint8_t keyZ(uint64_t key) { return key >> 56; }
+    uint32_t keyX(uint64_t key) { return (key >> 28) & 0x0FFFFFFF; }
+    uint32_t keyY(uint64_t key) { return key & 0x0FFFFFFF; }
+}
+
+TileDiskCache::~TileDiskCache()
+{
+    end();
+}
+
+uint32_t TileDiskCache::hashProvider(const TileProvider &provider)
+{
+    // FNV-1a over the url template keeps each provider's tiles in its own directory
+    uint32_t hash = 2166136261u;
+    for (const char *p = provider.urlTemplate; *p; ++p)
+        hash = (hash ^ static_cast<uint8_t>(*p)) * 16777619u;
+    return hash;
+}
+
+bool TileDiskCache::acquire()
+{
+    ++users;
+    if (enabled)
+        return true;
+    --users;
+    return false;
+}
+
+void TileDiskCache::release()
+{
+    --users;
+}
+
+bool TileDiskCache::begin(fs::FS &filesystem, const char *root, uint64_t maxSize, const TileProvider &provider)
+{
+    end();
+
+    if (!maxSize || !root || root[0] != '/' || strlen(root) >= sizeof(rootDir))
+    {
+        log_e("Invalid disk cache settings");
+        return false;
+    }
+
+    fs = &filesystem;
+    snprintf(rootDir, sizeof(rootDir), "%s", root);
+    maxBytes = maxSize;
+    maxEntries = std::max<size_t>(256, maxBytes / OSM_DISKCACHE_BYTES_PER_ENTRY);
+    stats = {};
+
+    mutex = xSemaphoreCreateMutex();
+    jobQueue = xQueueCreate(OSM_DISKCACHE_QUEUE_SIZE, sizeof(DiskJob *));
+    if (!mutex || !jobQueue)
+    {
+        log_e("Failed to create disk cache queue");
+        end();
+        return false;
+    }
+
+    fs->mkdir(rootDir);
+
+    ownerTask = xTaskGetCurrentTaskHandle();
+    if (!xTaskCreate(writerTaskFunction, "osm-disk", OSM_DISKCACHE_TASK_STACKSIZE, this, OSM_DISKCACHE_TASK_PRIORITY, &writerTask))
+    {
+        log_e("Failed to create disk cache task");
+        writerTask = nullptr;
+        end();
+        return false;
+    }
+
+    // The index is filled by the writer task, until then lookups simply miss
+    enabled = true;
+    setProvider(provider);
+    log_i("Disk cache enabled at %s (%llu kB max)", rootDir, maxBytes / 1024);
+    return true;
+}
+
+void TileDiskCache::end()
+{
+    // New callers are turned away, the ones already inside read() or store() finish first
+    enabled = false;
+    while (users)
+        vTaskDelay(1);
+
+    if (writerTask)
+    {
+        ownerTask = xTaskGetCurrentTaskHandle();
+        DiskJob *poison = nullptr;
+        xQueueSend(jobQueue, &poison, portMAX_DELAY);
+        ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
+        writerTask = nullptr;
+    }
+
+    if (jobQueue)
+    {
+        DiskJob *job;
+        while (xQueueReceive(jobQueue, &job, 0) == pdPASS)
+            delete job;
+        vQueueDelete(jobQueue);
+        jobQueue = nullptr;
+    }
+
+    if (mutex)
+    {
+        vSemaphoreDelete(mutex);
+        mutex = nullptr;
+    }
+
+    std::vector<Entry>().swap(entries);
+    index.clear();
+    indexCapacity = 0;
+    totalBytes = 0;
+    fs = nullptr;
+}
+
+void TileDiskCache::setProvider(const TileProvider &provider)
+{
+    if (!acquire())
+        return;
+
+    xSemaphoreTake(mutex, portMAX_DELAY);
+    providerHash = hashProvider(provider);
+    std::vector<Entry>().swap(entries);
+    index.clear();
+    indexCapacity = 0;
+    totalBytes = 0;
+    xSemaphoreGive(mutex);
+
+    DiskJob *rescan = new (std::nothrow) DiskJob{RESCAN_KEY, providerHash, MemoryBuffer::empty(), {}};
+    if (rescan && xQueueSend(jobQueue, &rescan, portMAX_DELAY) != pdPASS)
+        delete rescan;
+    release();
+}
+
+void TileDiskCache::makePath(char *path, uint32_t hash, uint64_t key, const char *extension)
+{
+    snprintf(path, OSM_DISKCACHE_MAX_PATH_LEN, "%s/%08lx/%u/%lu/%lu.%s",
+             rootDir, (unsigned long)hash, keyZ(key), (unsigned long)keyX(key), (unsigned long)keyY(key), extension);
+}
+
+void TileDiskCache::makeDirs(uint32_t hash, uint64_t key)
+{
+    char path[OSM_DISKCACHE_MAX_PATH_LEN];
+    snprintf(path, sizeof(path), "%s/%08lx", rootDir, (unsigned long)hash);
+    fs->mkdir(path);
+    snprintf(path, sizeof(path), "%s/%08lx/%u", rootDir, (unsigned long)hash, keyZ(key));
+    fs->mkdir(path);
+    snprintf(path, sizeof(path), "%s/%08lx/%u/%lu", rootDir, (unsigned long)hash, keyZ(key), (unsigned long)keyX(key));
+    fs->mkdir(path);
+}
+
+MemoryBuffer TileDiskCache::read(uint32_t x, uint32_t y, uint8_t z, TileValidators *validators)
+{
+    if (!acquire())
+        return MemoryBuffer::empty();
+
+    const uint64_t key = TileCacheIndex::makeKey(x, y, z);
+    xSemaphoreTake(mutex, portMAX_DELAY);
+    const int position = index.find(key);
+    if (position < 0)
+    {
+        ++stats.misses;
+        xSemaphoreGive(mutex);
+        release();
+        return MemoryBuffer::empty();
+    }
+    entries[position].lastUse = ++useTick;
+    const uint32_t hash = providerHash;
+    xSemaphoreGive(mutex);
+
+    char path[OSM_DISKCACHE_MAX_PATH_LEN];
+    makePath(path, hash, key, "png");
+
+    MemoryBuffer buffer = MemoryBuffer::empty();
+    File file = fs->open(path, "r");
+    if (file && file.size())
+    {
+        buffer = MemoryBuffer(file.size());
+        if (buffer.isAllocated() && file.read(buffer.get(), buffer.size()) != buffer.size())
+            buffer = MemoryBuffer::empty();
+    }
+
+    // Tiles stored without caching headers have expired
+    if (validators)
+    {
+        *validators = {};
+        makePath(path, hash, key, "hdr");
+        File header = fs->open(path, "r");
+        if (buffer.isAllocated() && header && header.read(reinterpret_cast<uint8_t *>(validators), sizeof(*validators)) != sizeof(*validators))
+            *validators = {};
+        makePath(path, hash, key, "png");
+    }
+
+    xSemaphoreTake(mutex, portMAX_DELAY);
+    if (buffer.isAllocated())
+        ++stats.hits;
+    else
+    {
+        log_w("Failed to read cached tile %s", path);
+        ++stats.misses;
+    }
+    xSemaphoreGive(mutex);
+    release();
+    return buffer;
+}
+
+void TileDiskCache::store(uint32_t x, uint32_t y, uint8_t z, MemoryBuffer &&png, const TileValidators &validators)
+{
+    if (!png.isAllocated() || !acquire())
+        return;
+
+    queueJob(new (std::nothrow) DiskJob{TileCacheIndex::makeKey(x, y, z), providerHash, std::move(png), validators});
+    release();
+}
+
+void TileDiskCache::refresh(uint32_t x, uint32_t y, uint8_t z, const TileValidators &validators)
+{
+    if (!acquire())
+        return;
+
+    queueJob(new (std::nothrow) DiskJob{TileCacheIndex::makeKey(x, y, z), providerHash, MemoryBuffer::empty(), validators});
+    release();
+}
+
+void TileDiskCache::queueJob(DiskJob *job)
+{
+    if (!job)
+        return;
+
+    // Never wait for the card, a full queue just means this tile is not persisted
+    if (xQueueSend(jobQueue, &job, 0) != pdPASS)
+    {
+        delete job;
+        xSemaphoreTake(mutex, portMAX_DELAY);
+        ++stats.droppedWrites;
+        xSemaphoreGive(mutex);
+    }
+}
+
+DiskCacheStats TileDiskCache::getStats()
+{
+    if (!acquire())
+        return stats;
+
+    xSemaphoreTake(mutex, portMAX_DELAY);
+    DiskCacheStats result = stats;
+    result.files = entries.size();
+    result.bytes = totalBytes;
+    xSemaphoreGive(mutex);
+    release();
+    return result;
+}
+
+bool TileDiskCache::addEntry(uint64_t key, uint32_t size)
+{
+    const int position = index.find(key);
+    if (position >= 0)
+    {
+        totalBytes = totalBytes - entries[position].size + size;
+        entries[position].size = size;
+        entries[position].lastUse = ++useTick;
+        return true;
+    }
+
+    if (entries.size() >= maxEntries)
+        return false;
+
+    entries.push_back({key, size, ++useTick});
+    if (entries.size() > indexCapacity)
+        growIndex();
+    index.insert(key, entries.size() - 1);
+    totalBytes += size;
+    return true;
+}
+
+void TileDiskCache::removeFiles(uint32_t hash, uint64_t key)
+{
+    char path[OSM_DISKCACHE_MAX_PATH_LEN];
+    makePath(path, hash, key, "png");
+    fs->remove(path);
+    makePath(path, hash, key, "hdr");
+    fs->remove(path);
+}
+
+bool TileDiskCache::isCurrent(uint32_t hash)
+{
+    xSemaphoreTake(mutex, portMAX_DELAY);
+    const bool current = hash == providerHash;
+    xSemaphoreGive(mutex);
+    return current;
+}
+
+void TileDiskCache::growIndex()
+{
+    // Sized for the files actually found, a large card with few tiles keeps a small table
+    indexCapacity = std::min(maxEntries, std::max(OSM_DISKCACHE_MIN_INDEX, indexCapacity * 2));
+    index.reserve(indexCapacity);
+    for (size_t i = 0; i < entries.size(); ++i)
+        index.insert(entries[i].key, i);
+}
+
+void TileDiskCache::removeEntry(size_t position)
+{
+    totalBytes -= entries[position].size;
+    index.erase(entries[position].key);
+    if (position != entries.size() - 1)
+    {
+        entries[position] = entries.back();
+        index.insert(entries[position].key, position);
+    }
+    entries.pop_back();
+}
+
+void TileDiskCache::scan()
+{
+    char path[OSM_DISKCACHE_MAX_PATH_LEN];
+    snprintf(path, sizeof(path), "%s/%08lx", rootDir, (unsigned long)providerHash);
+
+    [[maybe_unused]] const unsigned long startMS = millis();
+    size_t overflow = 0;
+
+    File providerDir = fs->open(path);
+    if (!providerDir || !providerDir.isDirectory())
+        return;
+
+    for (File zDir = providerDir.openNextFile(); zDir; zDir = providerDir.openNextFile())
+    {
+        if (!zDir.isDirectory())
+            continue;
+        const uint8_t z = atoi(zDir.name());
+
+        for (File xDir = zDir.openNextFile(); xDir; xDir = zDir.openNextFile())
+        {
+            if (!xDir.isDirectory())
+                continue;
+            const uint32_t x = strtoul(xDir.name(), nullptr, 10);
+
+            for (File tile = xDir.openNextFile(); tile; tile = xDir.openNextFile())
+            {
+                const char *name = tile.name();
+                const char *dot = strrchr(name, '.');
+                if (tile.isDirectory() || !dot || strcmp(dot, ".png"))
+                    continue;
+
+                const uint64_t key = TileCacheIndex::makeKey(x, strtoul(name, nullptr, 10), z);
+                xSemaphoreTake(mutex, portMAX_DELAY);
+                const bool indexed = addEntry(key, tile.size());
+                xSemaphoreGive(mutex);
+
+                // A file the index has no room for would never be evicted, so it does not stay
+                if (!indexed)
+                {
+                    tile.close();
+                    removeFiles(providerHash, key);
+                    ++overflow;
+                }
+            }
+        }
+    }
+
+    log_i("Indexed %u cached tiles (%llu kB) in %lu ms", entries.size(), totalBytes / 1024, millis() - startMS);
+    if (overflow)
+        log_w("Removed %u cached tiles over the %u file limit", overflow, maxEntries);
+    evict();
+}
+
+bool TileDiskCache::writeValidators(const DiskJob &job)
+{
+    char path[OSM_DISKCACHE_MAX_PATH_LEN];
+    makePath(path, job.providerHash, job.key, "hdr");
+    File file = fs->open(path, "w", true);
+    if (!file)
+    {
+        log_e("Failed to create %s", path);
+        return false;
+    }
+    const size_t written = file.write(reinterpret_cast<const uint8_t *>(&job.validators), sizeof(job.validators));
+    file.close();
+
+    if (written != sizeof(job.validators))
+    {
+        log_e("Short write on %s", path);
+        fs->remove(path);
+        return false;
+    }
+    return true;
+}
+
+void TileDiskCache::write(DiskJob &job)
+{
+    // Tiles of a provider that is no longer used would never be indexed or evicted
+    if (!isCurrent(job.providerHash))
+        return;
+
+    // An unchanged tile only gets its new expiry
+    if (!job.png.isAllocated())
+    {
+        if (!writeValidators(job))
+            return;
+
+        xSemaphoreTake(mutex, portMAX_DELAY);
+        const int position = job.providerHash == providerHash ? index.find(job.key) : -1;
+        if (position >= 0)
+            entries[position].lastUse = ++useTick;
+        ++stats.refreshes;
+        xSemaphoreGive(mutex);
+        return;
+    }
+
+    char tmpPath[OSM_DISKCACHE_MAX_PATH_LEN];
+    char path[OSM_DISKCACHE_MAX_PATH_LEN];
+    makePath(tmpPath, job.providerHash, job.key, "tmp");
+    makePath(path, job.providerHash, job.key, "png");
+
+    makeDirs(job.providerHash, job.key);
+
+    // Write to a temp file first so readers never see a partial tile
+    File file = fs->open(tmpPath, "w", true);
+    if (!file)
+    {
+        log_e("Failed to create %s", tmpPath);
+        return;
+    }
+    const size_t written = file.write(job.png.get(), job.png.size());
+    file.close();
+
+    if (written != job.png.size())
+    {
+        log_e("Short write on %s", tmpPath);
+        fs->remove(tmpPath);
+        return;
+    }
+
+    fs->remove(path);
+    if (!fs->rename(tmpPath, path))
+    {
+        log_e("Failed to rename %s", tmpPath);
+        fs->remove(tmpPath);
+        return;
+    }
+
+    // Without its headers the tile reads as expired, which only costs a revalidation
+    writeValidators(job);
+
+    // Room for the new entry is made first, so every file on disk stays in the index
+    evict();
+
+    xSemaphoreTake(mutex, portMAX_DELAY);
+    const bool indexed = job.providerHash == providerHash && addEntry(job.key, job.png.size());
+    if (indexed)
+        ++stats.writes;
+    else
+        ++stats.droppedWrites;
+    xSemaphoreGive(mutex);
+
+    if (!indexed)
+        removeFiles(job.providerHash, job.key);
+    evict();
+}
+
+void TileDiskCache::evict()
+{
+    std::vector<uint64_t> victims;
+
+    xSemaphoreTake(mutex, portMAX_DELAY);
+    if (totalBytes > maxBytes || entries.size() >= maxEntries)
+    {
+        // Evict the least recently used tiles down to 90% of the caps in one batch
+        const uint64_t targetBytes = maxBytes / 10 * 9;
+        const size_t targetEntries = maxEntries / 10 * 9;
+
+        std::vector<size_t> order(entries.size());
+        std::iota(order.begin(), order.end(), 0);
+        const auto older = [this](size_t a, size_t b)
+        { return entries[a].lastUse < entries[b].lastUse; };
+
+        uint64_t bytes = totalBytes;
+        size_t count = entries.size();
+        size_t first = 0;
+        while (first < order.size() && (bytes > targetBytes || count > targetEntries))
+        {
+            // Partition off about as many of the oldest tiles as are needed instead of sorting them all
+            size_t batch = count > targetEntries ? count - targetEntries : 1;
+            if (bytes > targetBytes)
+                batch = std::max<size_t>(batch, (bytes - targetBytes) / (bytes / count + 1) + 1);
+            batch = std::min(batch, order.size() - first);
+            std::nth_element(order.begin() + first, order.begin() + first + batch - 1, order.end(), older);
+
+            for (size_t i = first; i < first + batch && (bytes > targetBytes || count > targetEntries); ++i)
+            {
+                victims.push_back(entries[order[i]].key);
+                bytes -= entries[order[i]].size;
+                --count;
+            }
+            first += batch;
+        }
+
+        for (const uint64_t key : victims)
+            removeEntry(index.find(key));
+        stats.evictions += victims.size();
+    }
+    const uint32_t hash = providerHash;
+    xSemaphoreGive(mutex);
+
+    for (const uint64_t key : victims)
+        removeFiles(hash, key);
+
+    if (!victims.empty())
+        log_i("Evicted %u tiles from disk cache", victims.size());
+}
+
+void TileDiskCache::writerTaskFunction(void *param)
+{
+    TileDiskCache *cache = static_cast<TileDiskCache *>(param);
+    while (true)
+    {
+        DiskJob *job = nullptr;
+        xQueueReceive(cache->jobQueue, &job, portMAX_DELAY);
+        if (!job)
+            break;
+
+        if (job->key == RESCAN_KEY)
+        {
+            if (job->providerHash == cache->providerHash)
+                cache->scan();
+        }
+        else
+            cache->write(*job);
+
+        delete job;
+    }
+    xTaskNotifyGive(cache->ownerTask);
+    vTaskDelete(nullptr);
+}
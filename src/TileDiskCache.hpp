@@ -0,0 +1,134 @@
+/*
+    Copyright (c) 2025 Cellie https://github.com/CelliesProjects/OpenStreetMap-esp32
+
+    Permission is hereby granted, free of charge, to any person obtaining a copy
+    of this software and associated documentation files (the "Software"), to deal
+    in the Software without restriction, including without limitation the rights
+    to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+    copies of the Software, and to permit persons to whom the Software is
+    furnished to do so, subject to the following conditions:
+
+    The above copyright notice and this permission notice shall be included in all
+    copies or substantial portions of the Software.
+
+    THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+    IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+    FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+    AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+    LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+    OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+    SOFTWARE.
+    SPDX-License-Identifier: MIT
+    */
+
+#ifndef TILEDISKCACHE_HPP_
+#define TILEDISKCACHE_HPP_
+
+#include <Arduino.h>
+#include <FS.h>
+#include <vector>
+#include <atomic>
+
+#include "TileProvider.hpp"
+#include "TileCacheIndex.hpp"
+#include "MemoryBuffer.hpp"
+#include "TileValidators.hpp"
+
+constexpr int OSM_DISKCACHE_MAX_PATH_LEN = 96;
+constexpr uint32_t OSM_DISKCACHE_QUEUE_SIZE = 16;
+constexpr uint32_t OSM_DISKCACHE_TASK_STACKSIZE = 4096;
+constexpr UBaseType_t OSM_DISKCACHE_TASK_PRIORITY = 0;
+constexpr uint32_t OSM_DISKCACHE_BYTES_PER_ENTRY = 4096; // used to bound the number of indexed files
+constexpr size_t OSM_DISKCACHE_MIN_INDEX = 64;            // the index grows from here as files are found
+
+struct DiskCacheStats
+{
+    uint32_t hits;
+    uint32_t misses;
+    uint32_t writes;
+    uint32_t refreshes; // validators of an unchanged tile updated
+    uint32_t droppedWrites;
+    uint32_t evictions;
+    uint32_t files;
+    uint64_t bytes;
+};
+
+// Persistent second level tile cache on any fs::FS (SD, SD_MMC, LittleFS)
+// Tiles are stored as <root>/<provider hash>/<z>/<x>/<y>.png with their caching headers in <y>.hdr
+// Writes are queued and done by a low priority task so they never block map composition
+class TileDiskCache
+{
+public:
+    TileDiskCache() = default;
+    ~TileDiskCache();
+
+    TileDiskCache(const TileDiskCache &) = delete;
+    TileDiskCache &operator=(const TileDiskCache &) = delete;
+
+    bool begin(fs::FS &fs, const char *rootDir, uint64_t maxBytes, const TileProvider &provider);
+    void end();
+    bool isEnabled() const { return enabled.load(); };
+
+    void setProvider(const TileProvider &provider);
+    MemoryBuffer read(uint32_t x, uint32_t y, uint8_t z, TileValidators *validators = nullptr);
+    void store(uint32_t x, uint32_t y, uint8_t z, MemoryBuffer &&png, const TileValidators &validators = {});
+    void refresh(uint32_t x, uint32_t y, uint8_t z, const TileValidators &validators);
+    DiskCacheStats getStats();
+
+private:
+    struct Entry
+    {
+        uint64_t key;
+        uint32_t size;
+        uint32_t lastUse;
+    };
+
+    struct DiskJob
+    {
+        uint64_t key;
+        uint32_t providerHash;
+        MemoryBuffer png; // empty when only the validators are written
+        TileValidators validators;
+    };
+
+    fs::FS *fs = nullptr;
+    char rootDir[OSM_DISKCACHE_MAX_PATH_LEN / 2] = {0};
+    uint32_t providerHash = 0;
+    uint64_t maxBytes = 0;
+    size_t maxEntries = 0;
+
+    // Callers outside the writer task hold a lease so end() can wait for them before tearing down
+    std::atomic<bool> enabled = false;
+    std::atomic<uint32_t> users = 0;
+
+    SemaphoreHandle_t mutex = nullptr;
+    QueueHandle_t jobQueue = nullptr;
+    TaskHandle_t writerTask = nullptr;
+    TaskHandle_t ownerTask = nullptr;
+
+    std::vector<Entry> entries;
+    TileCacheIndex index;
+    size_t indexCapacity = 0;
+    uint64_t totalBytes = 0;
+    uint32_t useTick = 0;
+    DiskCacheStats stats = {};
+
+    static uint32_t hashProvider(const TileProvider &provider);
+    bool acquire();
+    void release();
+    void makePath(char *path, uint32_t hash, uint64_t key, const char *extension);
+    void makeDirs(uint32_t hash, uint64_t key);
+    void scan();
+    void write(DiskJob &job);
+    bool writeValidators(const DiskJob &job);
+    void queueJob(DiskJob *job);
+    void evict();
+    bool addEntry(uint64_t key, uint32_t size);
+    void removeFiles(uint32_t hash, uint64_t key);
+    bool isCurrent(uint32_t hash);
+    void growIndex();
+    void removeEntry(size_t position);
+    static void writerTaskFunction(void *param);
+};
+
+#endif
@@ -0,0 +1,103 @@
+/*
+    Copyright (c) 2025 Cellie https://github.com/CelliesProjects/OpenStreetMap-esp32
+
+    Permission is hereby granted, free of charge, to any person obtaining a copy
+    of this software and associated documentation files (the "Software"), to deal
+    in the Software without restriction, including without limitation the rights
+    to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+    copies of the Software, and to permit persons to whom the Software is
+    furnished to do so, subject to the following conditions:
+
+    The above copyright notice and this permission notice shall be included in all
+    copies or substantial portions of the Software.
+
+    THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+    IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+    FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+    AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+    LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+    OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+    SOFTWARE.
+    SPDX-License-Identifier: MIT
+    */
+
+#include "TileFailureCache.hpp"
+#include "TileCacheIndex.hpp"
+#include <algorithm>
+#include <climits>
+
+int TileFailureCache::find(const TileProvider *provider, uint64_t key) const
+{
+    for (int index = 0; index < OSM_FAILURE_CACHE_SIZE; ++index)
+    {
+        if (entries[index].provider == provider && entries[index].key == key)
+            return index;
+    }
+    return -1;
+}
+
+void TileFailureCache::fail(const TileProvider *provider, uint32_t x, uint32_t y, uint8_t z, unsigned long retryAfterMS)
+{
+    const uint64_t key = TileCacheIndex::makeKey(x, y, z);
+    const unsigned long nowMS = millis();
+    int index = find(provider, key);
+    if (index < 0)
+    {
+        // A free entry, or else the one whose backoff ends first
+        unsigned long shortestMS = ULONG_MAX;
+        for (int candidate = 0; candidate < OSM_FAILURE_CACHE_SIZE; ++candidate)
+        {
+            const Entry &entry = entries[candidate];
+            const unsigned long elapsedMS = nowMS - entry.failedMS;
+            const unsigned long leftMS = !entry.provider || elapsedMS >= entry.backoffMS ? 0 : entry.backoffMS - elapsedMS;
+            if (leftMS < shortestMS)
+            {
+                shortestMS = leftMS;
+                index = candidate;
+            }
+        }
+        entries[index] = {provider, key, 0, 0, 0};
+    }
+
+    Entry &entry = entries[index];
+    if (entry.failures < UINT8_MAX)
+        ++entry.failures;
+    entry.failedMS = nowMS;
+    entry.backoffMS = std::min(OSM_BACKOFF_START_MS << std::min<uint8_t>(entry.failures - 1, 16), OSM_BACKOFF_MAX_MS);
+    entry.backoffMS = std::max(entry.backoffMS, std::min(retryAfterMS, OSM_MAX_RETRY_AFTER_MS));
+    log_d("tile z=%u x=%lu y=%lu failed %u times, next try in %lu ms", z, x, y, entry.failures, entry.backoffMS);
+
+    if (retryAfterMS)
+        pause(provider, std::min(retryAfterMS, OSM_MAX_RETRY_AFTER_MS));
+}
+
+void TileFailureCache::pause(const TileProvider *provider, unsigned long retryAfterMS)
+{
+    // Every tile answered with a Retry-After extends the pause, it is never shortened
+    const unsigned long nowMS = millis();
+    if (paused(provider) && pauseMS - (nowMS - pausedMS) >= retryAfterMS)
+        return;
+
+    pausedProvider = provider;
+    pausedMS = nowMS;
+    pauseMS = retryAfterMS;
+    log_w("provider paused for %lu ms", pauseMS);
+}
+
+bool TileFailureCache::paused(const TileProvider *provider) const
+{
+    return provider == pausedProvider && millis() - pausedMS < pauseMS;
+}
+
+void TileFailureCache::forget(const TileProvider *provider, uint32_t x, uint32_t y, uint8_t z)
+{
+    const int index = find(provider, TileCacheIndex::makeKey(x, y, z));
+    if (index >= 0)
+        entries[index] = {};
+}
+
+bool TileFailureCache::blocked(const TileProvider *provider, uint32_t x, uint32_t y, uint8_t z) const
+{
+    const int index = find(provider, TileCacheIndex::makeKey(x, y, z));
+    return index >= 0 && millis() - entries[index].failedMS < entries[index].backoffMS;
+}
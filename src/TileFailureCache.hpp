@@ -0,0 +1,65 @@
+/*
+    Copyright (c) 2025 Cellie https://github.com/CelliesProjects/OpenStreetMap-esp32
+
+    Permission is hereby granted, free of charge, to any person obtaining a copy
+    of this software and associated documentation files (the "Software"), to deal
+    in the Software without restriction, including without limitation the rights
+    to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+    copies of the Software, and to permit persons to whom the Software is
+    furnished to do so, subject to the following conditions:
+
+    The above copyright notice and this permission notice shall be included in all
+    copies or substantial portions of the Software.
+
+    THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+    IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+    FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+    AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+    LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+    OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+    SOFTWARE.
+    SPDX-License-Identifier: MIT
+    */
+
+#ifndef TILEFAILURECACHE_HPP_
+#define TILEFAILURECACHE_HPP_
+
+#include <Arduino.h>
+#include "TileProvider.hpp"
+
+constexpr int OSM_FAILURE_CACHE_SIZE = 64;                       // tiles remembered as failed
+constexpr unsigned long OSM_BACKOFF_START_MS = 2000;             // wait after the first failure, doubled for every next one
+constexpr unsigned long OSM_BACKOFF_MAX_MS = 10 * 60 * 1000;     // longest wait without a Retry-After
+constexpr unsigned long OSM_MAX_RETRY_AFTER_MS = 60 * 60 * 1000; // longest Retry-After that is honoured
+
+// Remembers tiles that failed to download or decode, so they are not requested again before their backoff ends
+// A Retry-After pauses the whole provider, the server asked every request to wait and not just this tile
+class TileFailureCache
+{
+public:
+    void fail(const TileProvider *provider, uint32_t x, uint32_t y, uint8_t z, unsigned long retryAfterMS = 0);
+    void forget(const TileProvider *provider, uint32_t x, uint32_t y, uint8_t z);
+    bool blocked(const TileProvider *provider, uint32_t x, uint32_t y, uint8_t z) const;
+    bool paused(const TileProvider *provider) const;
+
+private:
+    struct Entry
+    {
+        const TileProvider *provider; // nullptr when the entry is free
+        uint64_t key;
+        uint8_t failures;
+        unsigned long failedMS;
+        unsigned long backoffMS;
+    };
+
+    Entry entries[OSM_FAILURE_CACHE_SIZE] = {};
+
+    const TileProvider *pausedProvider = nullptr; // only the provider in use is ever paused
+    unsigned long pausedMS = 0;
+    unsigned long pauseMS = 0;
+
+    void pause(const TileProvider *provider, unsigned long retryAfterMS);
+    int find(const TileProvider *provider, uint64_t key) const;
+};
+
+#endif
@@ -32,6 +32,8 @@ struct TileJob
     uint32_t y;
     uint8_t z;
     CachedTile *tile;
+    bool prefetch;       // low priority job from motion prediction, not part of a map
+    uint32_t generation; // map that queued the job, a newer map supersedes it
 };
 
 static_assert(sizeof(TileJob) >= 0, "Suppress unusedStruct");
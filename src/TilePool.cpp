@@ -0,0 +1,119 @@
+/*
+    Copyright (c) 2025 Cellie https://github.com/CelliesProjects/OpenStreetMap-esp32
+
+    Permission is hereby granted, free of charge, to any person obtaining a copy
+    of this software and associated documentation files (the "Software"), to deal
+    in the Software without restriction, including without limitation the rights
+    to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+    copies of the Software, and to permit persons to whom the Software is
+    furnished to do so, subject to the following conditions:
+
+    The above copyright notice and this permission notice shall be included in all
+    copies or substantial portions of the Software.
+
+    THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+    IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+    FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+    AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+    LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+    OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+    SOFTWARE.
+    SPDX-License-Identifier: MIT
+    */
+
+#include "TilePool.hpp"
+
+TilePool::~TilePool()
+{
+    end();
+}
+
+bool TilePool::begin(size_t bytes)
+{
+    end();
+
+    arenaSize = bytes & ~(ALIGNMENT - 1);
+    arena = static_cast<uint8_t *>(heap_caps_malloc(arenaSize, MALLOC_CAP_SPIRAM));
+    if (!arena)
+    {
+        arenaSize = 0;
+        return false;
+    }
+
+    available = arenaSize;
+    freeBlocks.push_back({0, arenaSize});
+    return true;
+}
+
+void TilePool::end()
+{
+    if (arena)
+    {
+        heap_caps_free(arena);
+        arena = nullptr;
+    }
+    arenaSize = 0;
+    available = 0;
+    std::vector<Block>().swap(freeBlocks);
+}
+
+uint16_t *TilePool::allocate(size_t bytes)
+{
+    const size_t needed = HEADER_SIZE + ((bytes + ALIGNMENT - 1) & ~(ALIGNMENT - 1));
+
+    for (size_t i = 0; i < freeBlocks.size(); ++i)
+    {
+        Block &block = freeBlocks[i];
+        if (block.size < needed)
+            continue;
+
+        const size_t offset = block.offset;
+        if (block.size - needed < HEADER_SIZE + ALIGNMENT)
+        {
+            // Remainder too small to be useful, hand out the whole block
+            available -= block.size;
+            *reinterpret_cast<size_t *>(arena + offset) = block.size;
+            freeBlocks.erase(freeBlocks.begin() + i);
+        }
+        else
+        {
+            available -= needed;
+            *reinterpret_cast<size_t *>(arena + offset) = needed;
+            block.offset += needed;
+            block.size -= needed;
+        }
+        return reinterpret_cast<uint16_t *>(arena + offset + HEADER_SIZE);
+    }
+    return nullptr;
+}
+
+void TilePool::release(uint16_t *buffer)
+{
+    if (!buffer || !arena)
+        return;
+
+    const size_t offset = reinterpret_cast<uint8_t *>(buffer) - arena - HEADER_SIZE;
+    const size_t size = *reinterpret_cast<size_t *>(arena + offset);
+    available += size;
+
+    auto next = std::lower_bound(freeBlocks.begin(), freeBlocks.end(), offset, [](const Block &block, size_t value)
+                                 { return block.offset < value; });
+    auto inserted = freeBlocks.insert(next, {offset, size});
+
+    // Merge with the following and the preceding free block when they touch
+    auto following = inserted + 1;
+    if (following != freeBlocks.end() && inserted->offset + inserted->size == following->offset)
+    {
+        inserted->size += following->size;
+        freeBlocks.erase(following);
+    }
+    if (inserted != freeBlocks.begin())
+    {
+        auto preceding = inserted - 1;
+        if (preceding->offset + preceding->size == inserted->offset)
+        {
+            preceding->size += inserted->size;
+            freeBlocks.erase(inserted);
+        }
+    }
+}
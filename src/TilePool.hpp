@@ -0,0 +1,71 @@
+/*
+    Copyright (c) 2025 Cellie https://github.com/CelliesProjects/OpenStreetMap-esp32
+
+    Permission is hereby granted, free of charge, to any person obtaining a copy
+    of this software and associated documentation files (the "Software"), to deal
+    in the Software without restriction, including without limitation the rights
+    to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+    copies of the Software, and to permit persons to whom the Software is
+    furnished to do so, subject to the following conditions:
+
+    The above copyright notice and this permission notice shall be included in all
+    copies or substantial portions of the Software.
+
+    THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+    IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+    FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+    AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+    LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+    OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+    SOFTWARE.
+    SPDX-License-Identifier: MIT
+    */
+
+#ifndef TILEPOOL_HPP_
+#define TILEPOOL_HPP_
+
+#include <Arduino.h>
+#include <vector>
+
+// A single psram arena handing out variable sized tile buffers
+// Freed blocks are merged with their neighbours to keep fragmentation down
+class TilePool
+{
+public:
+    TilePool() = default;
+    ~TilePool();
+
+    TilePool(const TilePool &) = delete;
+    TilePool &operator=(const TilePool &) = delete;
+
+    bool begin(size_t bytes);
+    void end();
+    bool isAllocated() const { return arena != nullptr; };
+
+    uint16_t *allocate(size_t bytes);
+    void release(uint16_t *buffer);
+    size_t freeBytes() const { return available; };
+
+    static constexpr size_t ALIGNMENT = 8;
+    static constexpr size_t HEADER_SIZE = ALIGNMENT; // block size is stored in front of every buffer
+
+    // Arena size that holds count buffers of bytes each
+    static constexpr size_t bytesFor(size_t count, size_t bytes)
+    {
+        return count * (HEADER_SIZE + ((bytes + ALIGNMENT - 1) & ~(ALIGNMENT - 1)));
+    }
+
+private:
+    struct Block
+    {
+        size_t offset;
+        size_t size;
+    };
+
+    uint8_t *arena = nullptr;
+    size_t arenaSize = 0;
+    size_t available = 0;
+    std::vector<Block> freeBlocks; // sorted by offset
+};
+
+#endif
@@ -80,6 +80,7 @@ const TileProvider ThunderForestCycle256 = {
 const TileProvider tileProviders[] = {osmStandard};
 
 constexpr int OSM_TILEPROVIDERS = sizeof(tileProviders) / sizeof(TileProvider);
+constexpr int OSM_MAX_TILESIZE = 512;
 
 static_assert(OSM_TILEPROVIDERS > 0, "No TileProvider configured");
 
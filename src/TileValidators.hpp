@@ -0,0 +1,41 @@
+/*
+    Copyright (c) 2025 Cellie https://github.com/CelliesProjects/OpenStreetMap-esp32
+
+    Permission is hereby granted, free of charge, to any person obtaining a copy
+    of this software and associated documentation files (the "Software"), to deal
+    in the Software without restriction, including without limitation the rights
+    to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+    copies of the Software, and to permit persons to whom the Software is
+    furnished to do so, subject to the following conditions:
+
+    The above copyright notice and this permission notice shall be included in all
+    copies or substantial portions of the Software.
+
+    THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+    IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+    FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+    AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+    LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+    OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+    SOFTWARE.
+    SPDX-License-Identifier: MIT
+    */
+
+#ifndef TILEVALIDATORS_HPP_
+#define TILEVALIDATORS_HPP_
+
+#include <Arduino.h>
+
+constexpr int OSM_MAX_ETAG_LEN = 64;
+constexpr int OSM_MAX_HTTPDATE_LEN = 32;
+constexpr uint32_t OSM_DEFAULT_MAX_AGE = 7 * 24 * 3600; // lifetime of tiles served without caching headers
+
+// Caching headers kept with a persisted tile to revalidate it once it expires
+struct TileValidators
+{
+    char etag[OSM_MAX_ETAG_LEN];             // empty when the server sent none
+    char lastModified[OSM_MAX_HTTPDATE_LEN]; // verbatim Last-Modified header, empty when none
+    uint32_t expires;                        // unix time the tile goes stale, 0 when unknown
+};
+
+#endif
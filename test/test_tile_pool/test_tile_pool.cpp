@@ -0,0 +1,107 @@
+/*
+    Copyright (c) 2025 Cellie https://github.com/CelliesProjects/OpenStreetMap-esp32
+
+    Permission is hereby granted, free of charge, to any person obtaining a copy
+    of this software and associated documentation files (the "Software"), to deal
+    in the Software without restriction, including without limitation the rights
+    to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+    copies of the Software, and to permit persons to whom the Software is
+    furnished to do so, subject to the following conditions:
+
+    The above copyright notice and this permission notice shall be included in all
+    copies or substantial portions of the Software.
+
+    THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+    IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+    FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+    AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+    LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+    OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+    SOFTWARE.
+    SPDX-License-Identifier: MIT
+    */
+
+// Runs on an ESP32 with psram. The library has no PlatformIO project of its own, so copy this
+// folder into the test/ directory of a project that depends on the library and run `pio test -f test_tile_pool`
+
+#include <Arduino.h>
+#include <unity.h>
+#include "TilePool.hpp"
+
+constexpr size_t TEST_TILES = 12;
+
+static void fillEverySlot(int tileSize)
+{
+    const size_t tileBytes = tileSize * tileSize * sizeof(uint16_t);
+    TilePool pool;
+    TEST_ASSERT_TRUE(pool.begin(TilePool::bytesFor(TEST_TILES, tileBytes)));
+
+    uint16_t *buffers[TEST_TILES];
+    for (size_t index = 0; index < TEST_TILES; ++index)
+    {
+        buffers[index] = pool.allocate(tileBytes);
+        TEST_ASSERT_NOT_NULL_MESSAGE(buffers[index], "full tile did not fit");
+    }
+    TEST_ASSERT_NULL(pool.allocate(tileBytes));
+
+    // Every other buffer freed and the rest after it, the merged blocks hold full tiles again
+    for (size_t index = 0; index < TEST_TILES; index += 2)
+        pool.release(buffers[index]);
+    for (size_t index = 1; index < TEST_TILES; index += 2)
+        pool.release(buffers[index]);
+    TEST_ASSERT_EQUAL(TilePool::bytesFor(TEST_TILES, tileBytes), pool.freeBytes());
+
+    for (size_t index = 0; index < TEST_TILES; ++index)
+        TEST_ASSERT_NOT_NULL(pool.allocate(tileBytes));
+}
+
+static void test_pool_fragments_with_cropped_sizes()
+{
+    // Half, full, half and half sized buffers in an arena of three full tiles
+    const size_t fullBytes = 256 * 256 * sizeof(uint16_t);
+    const size_t halfBytes = fullBytes / 2;
+    TilePool pool;
+    TEST_ASSERT_TRUE(pool.begin(TilePool::bytesFor(3, fullBytes)));
+
+    uint16_t *first = pool.allocate(halfBytes);
+    TEST_ASSERT_NOT_NULL(pool.allocate(fullBytes));
+    uint16_t *third = pool.allocate(halfBytes);
+    uint16_t *fourth = pool.allocate(halfBytes);
+    TEST_ASSERT_NOT_NULL(first);
+    TEST_ASSERT_NOT_NULL(third);
+    TEST_ASSERT_NOT_NULL(fourth);
+
+    // The full buffer still in use splits the free space, a full tile does not fit although the bytes are there
+    pool.release(first);
+    pool.release(third);
+    TEST_ASSERT_GREATER_OR_EQUAL(TilePool::bytesFor(1, fullBytes), pool.freeBytes());
+    TEST_ASSERT_NULL(pool.allocate(fullBytes));
+
+    // Freeing the neighbour merges the tail into one block that holds it
+    pool.release(fourth);
+    TEST_ASSERT_NOT_NULL(pool.allocate(fullBytes));
+}
+
+static void test_pool_fills_every_256px_slot()
+{
+    fillEverySlot(256);
+}
+
+static void test_pool_fills_every_512px_slot()
+{
+    fillEverySlot(512);
+}
+
+void setup()
+{
+    delay(2000); // lets the serial monitor connect
+    UNITY_BEGIN();
+    RUN_TEST(test_pool_fills_every_256px_slot);
+    RUN_TEST(test_pool_fills_every_512px_slot);
+    RUN_TEST(test_pool_fragments_with_cropped_sizes);
+    UNITY_END();
+}
+
+void loop()
+{
+}